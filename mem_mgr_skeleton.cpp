@@ -6,40 +6,453 @@
 #include <assert.h>
 #include <stdbool.h>
 #include <cassert>
+#include <cctype>
+#include <cinttypes>
+#include <climits>
+#include <cmath>
 #include <cstdint>
-#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <list>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define TLB_SSE2 1
+#include <immintrin.h>
+#endif
+
+#if !defined(_WIN32)
+#define HAVE_MMAP 1
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #pragma warning(disable : 4996)
 
 #define ARGC_ERROR 1
 #define FILE_ERROR 2
 
-#define FRAME_SIZE  256
-#define FIFO 0
-#define LRU 1
-#define REPLACE_POLICY FIFO
+#define FRAME_SIZE  256        // default page size (--page-size), a power of two
+#define ADDRESS_BITS 16        // default virtual address width (--address-bits)
+#define PT_LEVELS 2            // default page-table depth (--levels)
+#define PT_MAX_LEVELS 4
+#define PT_MAX_NODE_BITS 20    // widest radix level: a node of 2^20 entries, beyond which a level is as bad as a flat table
+#define IPT_LINE 64            // inverted page table bucket size, one cache line
+#define IPT_WAYS 4             // keys per bucket
+#define IPT_EMPTY UINT32_MAX
+#define IPT_DELETED (UINT32_MAX - 1)
+#define DEFAULT_POLICY "fifo"      // see policies[] for the others, chosen with -p
+
+#define PAGEIN_READ 0     // fseek + fread into a buffer, then copy into the frame
+#define PAGEIN_MMAP 1     // copy straight out of the mapped backing store (-m)
+#define PAGEIN_REMAP 2    // point the frame at the mapped page, no copy at all (-z); frames are read-only
+#define MAX_CLUSTER 64    // largest fault-around cluster, in pages
+
+#define TRACE_MAGIC "MMTR"        // binary trace file, see write_trace_header()
+#define TRACE_VERSION 1
+#define TRACE_HAS_OPS 0x01        // header flag: a read/write bitmap follows each block
+#define TRACE_BLOCK_REFS 65536    // references per block
+#define TRACE_HEADER_SIZE 32
+#define TEXT_CHUNK (1 << 20)      // read size for text traces that cannot be mmapped (pipes, stdin)
+#define OP_READ 0
+#define OP_WRITE 1
+
+#define SPEC_NONE 0       // frame_node::speculative: referenced at least once
+#define SPEC_AROUND 1     // read by fault-around, not referenced yet
+#define SPEC_STRIDE 2     // read by the stride prefetcher, not referenced yet
+
+#define PF_STREAMS 8      // fault streams tracked by the stride prefetcher
+#define PF_WINDOW 16      // a fault this many pages from a stream's last fault retrains its stride
+#define PF_MAX_DEGREE 8   // most pages prefetched per triggering fault
+#define PF_EPOCH 16       // resolved prefetches between throttle decisions
+
+#define MAX_SWEEP 4096    // most configurations in one sweep
+#define MRC_MIN_SLOTS 65536   // smallest time axis of the stack-distance tree
+#define SHARDS_MODULUS (1u << 24)   // page hashes are taken mod this; a page is sampled when its hash is below the threshold
 
 // SET TO 128 to use replacement policy: FIFO or LRU,
-#define NFRAMES 128
-#define PTABLE_SIZE 256
+#define NFRAMES 128                      // defaults; -f, -l and -a choose others at run time
 #define TLB_SIZE 16
+#define TLB_WAYS 16                      // TLB_WAYS == TLB_SIZE is fully associative
+#define TLB_SETS (TLB_SIZE / TLB_WAYS)   // must be a power of two, indexed by the low page-number bits
+#define TLB_INVALID_TAG UINT64_MAX
+#define STLB_WAYS 8                      // second-level TLB associativity (--stlb-ways); --stlb sets its size
+#define TLB_FIFO 0                       // TLB replacement (--tlb-repl, --stlb-repl), see tlb_repl_names[]
+#define TLB_LRU 1
+#define TLB_PLRU 2                       // tree pseudo-LRU, needs power-of-two ways
+#define TLB_RANDOM 3
+#define TLB_NRU 4                        // one reference bit per entry, cleared across the set when all are set
+#define TLB_SRRIP 5                      // static re-reference interval prediction, 2-bit RRPVs
+#define SRRIP_MAX 3                      // distant re-reference; fills predict SRRIP_MAX - 1, hits 0
+#define TLB_CYCLES 1                     // default latencies (--tlb-latency): L1 TLB lookup,
+#define STLB_CYCLES 7                    // ... second-level TLB lookup,
+#define WALK_STEP_CYCLES 20              // ... and each node or cache line a page walk reads
+#define MAX_PROCESSES 4096                // address spaces in one multi-process trace, as many as 12-bit x86 PCIDs
+#define SHOW_PROCESSES 16                // per-process summary lines
+#define MAX_CORES 64                     // --cores: TLB sharers are a 64-bit mask per frame
+#define MC_ACCESS_BATCH 64               // TLB hits a core buffers before handing them to the replacement policy
+#define SHOOTDOWN_CYCLES 2000            // default cost (--ipi-cycles) to send one shootdown IPI and wait for its ack,
+#define IPI_CYCLES 1000                  // ... and to take the interrupt and invalidate on the receiving core
+#define PTE_PRESENT (1ull << 63)         // --concurrent: packed PTE bits; the low bits hold the frame
+#define PTE_LOADING (1ull << 62)         // a thread is reading the page in; the others wait for it
+#define PTE_USED (1ull << 61)            // referenced since the clock hand last passed
+#define PTE_FRAME ((1ull << 40) - 1)
+#define FRAME_CACHE 16                   // most free frames a thread takes from the shared pool at once
+#define HUGE_SIZES 2                     // huge page sizes beside the base page (--huge), as x86 has 2 MiB and 1 GiB beside 4 KiB
+#define HUGE_TLB_SIZE 4                  // entries in each huge-page TLB (--huge-tlb), fully associative
+#define TLBPF_NONE 0                     // TLB prefetching on a page walk (--tlb-prefetch), see tlbpf_names[]
+#define TLBPF_SEQUENTIAL 1               // the next page
+#define TLBPF_STRIDE 2                   // one miss distance further, once two misses in a row agree on it
+#define TLBPF_DISTANCE 3                 // the distances that followed this miss distance before
+#define TLBPF_ROWS 64                    // distance prefetcher: table rows, direct-mapped by distance
+#define TLBPF_SLOTS 2                    // ... next distances remembered per row, most recent first
+#define WB_BATCH 32                      // dirty pages queued (--wb-batch) before they are sorted and written out in runs
+
+static_assert(TLB_SIZE % TLB_WAYS == 0, "TLB_SIZE must be a multiple of TLB_WAYS");
+static_assert((TLB_SETS & (TLB_SETS - 1)) == 0, "TLB_SETS must be a power of two");
 
 struct page_node {    
     size_t npage;
     size_t frame_num;
     bool is_present;
     bool is_used;
+    bool is_dirty;    // written since it was paged in; in a TLB entry, the PTE already says so
+};
+
+#define NIL_FRAME ((size_t)-1)
+
+struct frame_node {   // inverse (frame -> page) entry
+    size_t npage;
+    bool is_mapped;
+    unsigned char speculative;   // SPEC_*: who loaded the page ahead of demand
+};
+
+// Translation structures. find() is the hardware walk and counts what it reads in
+// steps; map() and unmap() are the OS installing and removing a mapping; entry() is the
+// PTE of a mapped page.
+struct page_table {
+    size_t bytes = 0;                 // translation memory allocated so far
+    virtual ~page_table() {}
+    virtual page_node* find(size_t page, size_t& steps) = 0;   // nullptr (or a non-present entry) if unmapped
+    virtual page_node& map(size_t page, size_t frame) = 0;
+    virtual void unmap(size_t page) = 0;
+    virtual page_node& entry(size_t page) = 0;
+    virtual void describe() = 0;      // geometry, for the summary
+    virtual void select(size_t asid) { (void)asid; }   // address space of the next calls, for a table every process shares
+};
+
+// Multi-level radix page table. The virtual page number is cut into `levels` index
+// fields, top level first; interior nodes hold child pointers and leaves hold the
+// page_node entries. A node is allocated the first time a page under it is mapped, so
+// only the touched parts of the virtual address space take memory.
+struct radix_node {
+    std::vector<radix_node*> child;   // interior levels
+    std::vector<page_node> ptes;      // last level
+};
+
+// Cuts a vpn_bits page number into at most nlevels index fields, top first; the top
+// levels take any bits that don't divide evenly. Returns the number of levels.
+unsigned split_levels(unsigned vpn_bits, unsigned nlevels, unsigned* bits, unsigned* shift) {
+    unsigned levels = std::max(1u, std::min(nlevels, vpn_bits));
+    for (unsigned l = 0, left = vpn_bits; l < levels; l++) {
+        bits[l] = left / (levels - l) + (left % (levels - l) != 0);
+        left -= bits[l];
+        shift[l] = left;
+    }
+    return levels;
+}
+
+struct radix_page_table : page_table {
+    unsigned levels = 0;
+    unsigned bits[PT_MAX_LEVELS];     // index bits per level, top first
+    unsigned shift[PT_MAX_LEVELS];    // where each level's field starts in the page number
+    radix_node* root = nullptr;
+    size_t nodes = 0;                 // allocated so far
+
+    radix_page_table(unsigned vpn_bits, unsigned nlevels) {
+        levels = split_levels(vpn_bits, nlevels, bits, shift);
+        root = make_node(0, 0);
+    }
+    ~radix_page_table() { release(root, 0); }
+
+    radix_node* make_node(unsigned level, size_t first_page) {
+        radix_node* n = new radix_node;
+        size_t fanout = (size_t)1 << bits[level];
+        if (level + 1 == levels) {
+            n->ptes.resize(fanout);
+            for (size_t i = 0; i < fanout; i++) { n->ptes[i] = { first_page + i, NIL_FRAME, false, false, false }; }
+            bytes += fanout * sizeof(page_node);
+        } else {
+            n->child.assign(fanout, nullptr);
+            bytes += fanout * sizeof(radix_node*);
+        }
+        ++nodes;
+        return n;
+    }
+    void release(radix_node* n, unsigned level) {
+        if (n == nullptr) { return; }
+        if (level + 1 < levels) {
+            for (radix_node* c : n->child) { release(c, level + 1); }
+        }
+        delete n;
+    }
+    size_t index(size_t page, unsigned level) const { return (page >> shift[level]) & (((size_t)1 << bits[level]) - 1); }
+
+    page_node* find(size_t page, size_t& steps) override {  // steps += nodes visited
+        radix_node* n = root;
+        for (unsigned l = 0; ; l++) {
+            ++steps;
+            if (l + 1 == levels) { return &n->ptes[index(page, l)]; }
+            n = n->child[index(page, l)];
+            if (n == nullptr) { return nullptr; }
+        }
+    }
+    page_node& entry(size_t page) override {   // allocating the nodes down to page
+        radix_node* n = root;
+        for (unsigned l = 0; ; l++) {
+            size_t i = index(page, l);
+            if (l + 1 == levels) { return n->ptes[i]; }
+            if (n->child[i] == nullptr) { n->child[i] = make_node(l + 1, (page >> shift[l]) << shift[l]); }
+            n = n->child[i];
+        }
+    }
+    page_node& map(size_t page, size_t frame) override {
+        page_node& e = entry(page);
+        e.frame_num = frame;
+        e.is_present = true;
+        e.is_used = true;
+        e.is_dirty = false;
+        return e;
+    }
+    void unmap(size_t page) override { entry(page).is_present = false; }
+    void describe() override {
+        printf("%u-level radix (", levels);
+        for (unsigned l = 0; l < levels; l++) { printf(l ? "+%u" : "%u", bits[l]); }
+        printf(" bits), %zu nodes", nodes);
+    }
+};
+
+// Hashed inverted page table: one PTE per physical frame, found through an open-addressed
+// hash of (ASID, virtual page). Buckets are one cache line of IPT_WAYS keys and are probed
+// linearly, so a walk costs the cache lines it reads. Translation memory is O(frames)
+// however large and sparse the virtual address space. Removed keys leave tombstones that
+// keep probe chains intact; the table is rehashed in place when they pile up.
+struct alignas(IPT_LINE) ipt_bucket {
+    uint64_t page[IPT_WAYS];
+    uint32_t asid[IPT_WAYS];
+    uint32_t frame[IPT_WAYS];         // IPT_EMPTY, IPT_DELETED or the frame mapping the page
+};
+static_assert(sizeof(ipt_bucket) == IPT_LINE, "an inverted page table bucket must fill one cache line");
+
+struct hashed_page_table : page_table {
+    std::vector<ipt_bucket> buckets;  // a power of two, at least twice as many slots as frames
+    std::vector<page_node> ptes;      // indexed by frame
+    uint32_t asid = 0;                // address space of the lookups
+    size_t tombstones = 0;
+
+    hashed_page_table(size_t nframes) : ptes(nframes) {
+        size_t n = 1;
+        while (n * IPT_WAYS < 2 * nframes) { n *= 2; }
+        buckets.resize(n);
+        clear();
+        for (size_t f = 0; f < nframes; f++) { ptes[f] = { NIL_FRAME, f, false, false, false }; }
+        bytes = buckets.size() * sizeof(ipt_bucket) + ptes.size() * sizeof(page_node);
+    }
+
+    void clear() {
+        for (ipt_bucket& b : buckets) {
+            for (int w = 0; w < IPT_WAYS; w++) { b.frame[w] = IPT_EMPTY; }
+        }
+        tombstones = 0;
+    }
+    size_t home(size_t page) const {
+        uint64_t h = ((uint64_t)page ^ ((uint64_t)asid << 48)) * 0x9e3779b97f4a7c15ull;
+        return (size_t)(h >> 32) & (buckets.size() - 1);
+    }
+    bool locate(size_t page, size_t& bucket, int& way, size_t& steps) const {  // the slot holding page, if mapped
+        for (size_t b = home(page), probes = 0; probes < buckets.size(); b = (b + 1) & (buckets.size() - 1), probes++) {
+            ++steps;
+            const ipt_bucket& k = buckets[b];
+            for (int w = 0; w < IPT_WAYS; w++) {
+                if (k.frame[w] == IPT_EMPTY) { return false; }
+                if (k.frame[w] != IPT_DELETED && k.page[w] == page && k.asid[w] == asid) {
+                    bucket = b;
+                    way = w;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+    void insert(size_t page, size_t frame) {
+        for (size_t b = home(page); ; b = (b + 1) & (buckets.size() - 1)) {
+            ipt_bucket& k = buckets[b];
+            for (int w = 0; w < IPT_WAYS; w++) {
+                if (k.frame[w] == IPT_EMPTY || k.frame[w] == IPT_DELETED) {
+                    if (k.frame[w] == IPT_DELETED) { --tombstones; }
+                    k.page[w] = page;
+                    k.asid[w] = asid;
+                    k.frame[w] = (uint32_t)frame;
+                    return;
+                }
+            }
+        }
+    }
+    void rehash() {   // drop the tombstones: reinsert every mapped frame
+        uint32_t current = asid;
+        std::vector<ipt_bucket> old;
+        old.swap(buckets);
+        buckets.resize(old.size());
+        clear();
+        for (const ipt_bucket& k : old) {
+            for (int w = 0; w < IPT_WAYS; w++) {
+                if (k.frame[w] == IPT_EMPTY || k.frame[w] == IPT_DELETED) { continue; }
+                asid = k.asid[w];
+                insert((size_t)k.page[w], k.frame[w]);
+            }
+        }
+        asid = current;
+    }
+
+    page_node* find(size_t page, size_t& steps) override {
+        size_t b;
+        int w;
+        return locate(page, b, w, steps) ? &ptes[buckets[b].frame[w]] : nullptr;
+    }
+    page_node& entry(size_t page) override {
+        size_t steps = 0;
+        page_node* e = find(page, steps);
+        if (e == nullptr) { fprintf(stderr, "Error: page %zu has no inverted page table entry\n", page);  exit(-1); }
+        return *e;
+    }
+    void select(size_t space) override { asid = (uint32_t)space; }
+    page_node& map(size_t page, size_t frame) override {
+        size_t b, steps = 0;
+        int w;
+        if (locate(page, b, w, steps)) { buckets[b].frame[w] = (uint32_t)frame; } else { insert(page, frame); }
+        ptes[frame] = { page, frame, true, true, false };
+        return ptes[frame];
+    }
+    void unmap(size_t page) override {
+        size_t b, steps = 0;
+        int w;
+        if (!locate(page, b, w, steps)) { return; }
+        ptes[buckets[b].frame[w]].is_present = false;
+        buckets[b].frame[w] = IPT_DELETED;
+        if (++tombstones > buckets.size() * IPT_WAYS / 4) { rehash(); }
+    }
+    void describe() override {
+        printf("hashed inverted (%zu buckets of %d, %zu-byte lines)", buckets.size(), IPT_WAYS, sizeof(ipt_bucket));
+    }
+};
+
+struct simulator;
+struct trace_source;
+struct value_source;
+
+// A replacement policy sees every reference to a resident page (on_access), every page
+// loaded on a fault (on_fault), and picks the frame to give up when memory is full
+// (choose_victim, told which page is about to come in). page_fault() unmaps the victim.
+struct replace_policy {
+    simulator& sim;     // whose frames and page table the policy manages
+
+    replace_policy(simulator& s) : sim(s) {}
+    virtual ~replace_policy() {}
+    virtual void on_access(size_t) {}
+    virtual void on_fault(size_t, size_t) {}
+    virtual void on_prefetch(size_t page, size_t frame) { on_fault(page, frame); }   // loaded without a reference
+    virtual size_t choose_victim(size_t page) = 0;
+};
+
+struct sim_options {
+    const char* policy_name = DEFAULT_POLICY;
+    size_t nframes = NFRAMES;     // physical frames (-f)
+    size_t tlb_size = TLB_SIZE;   // TLB entries (-l)
+    size_t tlb_ways = TLB_WAYS;   // TLB associativity (-a), capped at tlb_size
+    int tlb_repl = TLB_FIFO;
+    size_t stlb_size = 0;         // second-level TLB entries (--stlb), 0 for none
+    size_t stlb_ways = STLB_WAYS;
+    int stlb_repl = TLB_LRU;
+    bool stlb_exclusive = false;  // L1 victims fill the STLB, instead of every walk filling both
+    unsigned latency[3] = { TLB_CYCLES, STLB_CYCLES, WALK_STEP_CYCLES };
+    bool show_latency = false;    // --tlb-latency given: report translation cycles even without an STLB
+    unsigned address_bits = ADDRESS_BITS;
+    size_t page_size = FRAME_SIZE;
+    unsigned page_bits = 8;       // log2(page_size)
+    size_t max_page = 0xff;       // highest virtual page number
+    unsigned vpn_bits = 8;        // bits in a virtual page number; a process's ASID sits above them in page keys
+    unsigned pt_levels = PT_LEVELS;
+    bool inverted = false;        // hashed inverted page table (--ipt) instead of the radix tree
+    size_t huge_pages[HUGE_SIZES] = {};   // base pages per huge page, smallest first (--huge)
+    unsigned huge_count = 0;
+    size_t huge_tlb = HUGE_TLB_SIZE;
+    size_t promote_refs = 0;      // references that make a resident region hot (--promote), 0 for its page count
+    int pagein = PAGEIN_READ;
+    size_t cluster = 1;    // pages read per fault (-c), aligned on the cluster size
+    bool prefetch = false; // stride/sequential prefetcher (-s)
+    bool quiet = false;    // no per-reference log lines (-q)
+    const char* address_file = "addresses.txt";   // text addresses or a binary trace (-t)
+    const char* correct_file = "correct.txt";     // expected values (-x), not checked with -n
+    bool verify = true;
+    size_t window = 0;     // references per rolling-statistics line (-w), 0 for none
+    size_t jobs = 0;       // sweep worker threads (-j), 0 for one per core
+    size_t quantum = 0;    // multi-process traces: references per time slice (--quantum), 0 to follow the trace's order
+    bool tlb_flush = false;     // flush the TLBs on every context switch (--flush) instead of keeping ASID-tagged entries
+    unsigned ipi_cycles[2] = { SHOOTDOWN_CYCLES, IPI_CYCLES };   // shootdown sender, receiver
+    int tlb_prefetch = TLBPF_NONE;
+    size_t tlb_pf_buffer = 0;     // prefetched translations held apart from the TLB (--tlb-prefetch-buffer), 0 to fill the TLB
+    bool write_back = false;      // write dirty victims to the backing store (--write-back) instead of only counting the writes
+    size_t wb_batch = WB_BATCH;
+};
+
+struct sim_stats {
+    size_t pagein_reads;       // requests to the backing store: reads, or runs of pages taken from its mapping
+    size_t prefetched;         // pages brought in ahead of demand
+    size_t prefetch_used;      // ... later referenced
+    size_t prefetch_wasted;    // ... evicted without ever being referenced
+    size_t pf_issued;          // stride prefetcher: pages prefetched
+    size_t pf_useful;          // ... later referenced
+    size_t pf_useless;         // ... evicted without ever being referenced
+    size_t pf_evictions;       // resident pages evicted to make room for a prefetch
+    size_t pf_pollution;       // ... that were demanded again before the prefetcher let go of them
+    size_t walks;              // page-table walks, one per TLB miss
+    size_t walk_steps;         // page-table nodes (radix) or cache lines (inverted) read by those walks
+    size_t tlbpf_walks;        // TLB prefetcher: walks for predicted pages, off the critical path
+    size_t tlbpf_steps;        // ... and what they read
+    size_t tlbpf_filled;       // ... translations installed, the page being resident
+    size_t tlbpf_useful;       // ... later used, each a demand walk saved
+    size_t writes;             // write references
+    size_t dirty_updates;      // ... through a TLB entry not yet marked dirty, so the PTE had to be updated
+    size_t dirtied;            // clean resident pages made dirty
+    size_t clean_evictions;    // victims dropped, the backing store holding the same bytes
+    size_t dirty_evictions;    // victims queued for write-back
+    size_t wb_pages;           // pages written to the backing store
+    size_t wb_writes;          // ... in this many write requests, one per run of consecutive pages
+    size_t wb_reclaimed;       // pages faulted back in from the queue before their write, which is then dropped
 };
 
-char* ram = (char*)malloc(NFRAMES * FRAME_SIZE);
-page_node pg_table[PTABLE_SIZE];  // page table and (single) TLB
-page_node tlb[TLB_SIZE];
+sim_options options;   // from the command line; every simulator starts from a copy
+
+const char* backing_map = nullptr;   // the mapped backing store, shared read-only by all simulators
+size_t backing_size = 0;
 
 const char* passed_or_failed(bool condition) { return condition ? " + " : "fail"; }
-size_t failed_asserts = 0;
 
-size_t get_page(size_t x)   { return 0xff & (x >> 8); }
-size_t get_offset(size_t x) { return 0xff & x; }
+size_t get_page(size_t x)   { return options.max_page & (x >> options.page_bits); }
+size_t get_offset(size_t x) { return (options.page_size - 1) & x; }
 
 void get_page_offset(size_t x, size_t& page, size_t& offset) {
     page = get_page(x);
@@ -48,125 +461,1072 @@ void get_page_offset(size_t x, size_t& page, size_t& offset) {
     //        x, page, offset, (page << 8) | get_offset(x), page * 256 + offset);
 }
 
-void update_frame_ptable(size_t npage, size_t frame_num) {
-    pg_table[npage].frame_num = frame_num;
-    pg_table[npage].is_present = true;
-    pg_table[npage].is_used = true;
-}
+struct page_list {   // ordered set of pages with O(1) push, touch, remove and pop; front is most recent
+    std::list<size_t> order;
+    std::unordered_map<size_t, std::list<size_t>::iterator> where;
+
+    size_t size() const { return where.size(); }
+    bool contains(size_t page) const { return where.count(page) != 0; }
+    size_t back() const { return order.back(); }
+
+    void push_front(size_t page) {
+        order.push_front(page);
+        where[page] = order.begin();
+    }
+    void touch(size_t page) {
+        auto it = where.find(page);
+        if (it == where.end()) { push_front(page); return; }
+        order.splice(order.begin(), order, it->second);
+    }
+    void remove(size_t page) {
+        auto it = where.find(page);
+        if (it == where.end()) { return; }
+        order.erase(it->second);
+        where.erase(it);
+    }
+    size_t pop_back() {
+        size_t page = order.back();
+        remove(page);
+        return page;
+    }
+};
 
-int find_frame_ptable(size_t frame) {  // FIFO
-    for (int i = 0; i < PTABLE_SIZE; i++) {
-        if (pg_table[i].frame_num == frame && 
-            pg_table[i].is_present == true) { return i; }
+// Adaptive prefetcher trained on the demand-fault stream. Each stream remembers its
+// last faulting page and stride; two faults in a row with the same stride (or a fault
+// just past the pages already prefetched) confirm it, and the next `degree` pages along
+// the stride are brought in, evicting through the replacement policy if memory is full.
+// Every PF_EPOCH resolved prefetches the degree doubles when at least 3/4 were used and
+// halves when fewer than 2/5 were.
+struct pf_stream {
+    bool valid;
+    size_t last;        // last demand fault in this stream
+    long long stride;
+    size_t frontier;    // farthest page prefetched along the stride
+    int confidence;
+    size_t stamp;
+};
+
+struct stride_prefetcher {
+    simulator& sim;
+    pf_stream streams[PF_STREAMS] = {};
+    size_t degree = 2, tick = 0;
+    size_t epoch_useful = 0, epoch_total = 0;
+    page_list victims;   // pages recently evicted by prefetches, to catch pollution
+
+    stride_prefetcher(simulator& s) : sim(s) {}
+
+    void feedback(bool useful) {
+        epoch_useful += useful;
+        if (++epoch_total < PF_EPOCH) { return; }
+        if (4 * epoch_useful >= 3 * epoch_total && degree < PF_MAX_DEGREE) {
+            degree *= 2;
+        } else if (5 * epoch_useful < 2 * epoch_total && degree > 1) {
+            degree /= 2;
+        }
+        epoch_useful = epoch_total = 0;
+    }
+
+    pf_stream* train(size_t page) {  // the stream page continues with a confirmed stride, or nullptr
+        ++tick;
+        for (pf_stream& s : streams) {
+            if (!s.valid || s.stride == 0) { continue; }
+            if ((long long)page - (long long)s.last == s.stride ||
+                (long long)page - (long long)s.frontier == s.stride) {
+                s.last = page;
+                if (s.frontier != page && ((long long)page - (long long)s.frontier) * s.stride > 0) { s.frontier = page; }
+                if (s.confidence < 3) { ++s.confidence; }
+                s.stamp = tick;
+                return &s;
+            }
+        }
+        pf_stream* slot = &streams[0];
+        for (pf_stream& s : streams) {
+            long long delta = (long long)page - (long long)s.last;
+            if (s.valid && delta != 0 && delta >= -PF_WINDOW && delta <= PF_WINDOW) { slot = &s; break; }
+            if (!s.valid || s.stamp < slot->stamp) { slot = &s; }
+        }
+        long long delta = (long long)page - (long long)slot->last;
+        bool near = slot->valid && delta != 0 && delta >= -PF_WINDOW && delta <= PF_WINDOW;
+        *slot = { true, page, near ? delta : 0, page, 0, tick };
+        return nullptr;
+    }
+
+    bool prefetch_page(size_t p);
+    void on_fault(size_t page);
+};
+
+int probe_tlb_set(const uint64_t* tags, size_t ways, uint64_t tag) {  // way holding tag, or -1
+    size_t w = 0;
+#if defined(__AVX2__)
+    const __m256i key4 = _mm256_set1_epi64x((long long)tag);
+    for (; w + 4 <= ways; w += 4) {
+        __m256i eq = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*)(tags + w)), key4);
+        int mask = _mm256_movemask_pd(_mm256_castsi256_pd(eq));
+        if (mask) { return (int)w + ((mask & 1) ? 0 : (mask & 2) ? 1 : (mask & 4) ? 2 : 3); }
+    }
+#endif
+#if defined(TLB_SSE2)
+    const __m128i key2 = _mm_set1_epi64x((long long)tag);
+    for (; w + 2 <= ways; w += 2) {
+        __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(tags + w)), key2);
+        eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));  // both halves must match
+        int mask = _mm_movemask_pd(_mm_castsi128_pd(eq));
+        if (mask) { return (int)w + ((mask & 1) ? 0 : 1); }
+    }
+#endif
+    for (; w < ways; w++) {
+        if (tags[w] == tag) { return (int)w; }
     }
     return -1;
 }
 
-size_t get_used_ptable() {  // LRU
-    size_t unused = -1;
-    for (size_t i = 0; i < PTABLE_SIZE; i++) {
-        if (pg_table[i].is_used == false && 
-            pg_table[i].is_present == true) { return (size_t)i; }
+const char* tlb_repl_names[] = { "fifo", "lru", "plru", "random", "nru", "srrip" };   // indexed by TLB_*
+
+// A set-associative translation cache. Tags are page numbers in the base TLBs and region
+// numbers in the huge-page TLBs. FIFO fills each set round-robin; the other policies
+// fill an empty way first and are told about every hit through touch().
+struct tlb_array {
+    size_t size = 0, ways = 1, sets = 1;
+    int repl = TLB_FIFO;
+    std::vector<page_node> entries;
+    std::vector<uint64_t> tags;       // set s owns tags[s * ways .. (s + 1) * ways), probed with SIMD
+    std::vector<size_t> fill;         // FIFO: per-set round-robin fill pointer
+    std::vector<uint64_t> stamp;      // LRU: last use of each entry
+    std::vector<unsigned char> tree;  // PLRU: per set, ways - 1 node bits heap-ordered from 1, each pointing at the colder half
+    std::vector<unsigned char> rrpv;  // NRU: reference bit of each entry; SRRIP: its re-reference prediction value
+    uint64_t clock = 0, seed = 0x9e3779b97f4a7c15ull;
+    size_t hits = 0;
+
+    void init(size_t n, size_t w, int policy = TLB_FIFO) {
+        size = n;
+        ways = std::min(w, n);
+        sets = ways ? size / ways : 0;
+        repl = policy;
+        entries.assign(size, { (size_t)-1, NIL_FRAME, false, false, false });
+        tags.assign(size, TLB_INVALID_TAG);
+        fill.assign(sets, 0);
+        stamp.assign(policy == TLB_LRU ? size : 0, 0);
+        tree.assign(policy == TLB_PLRU ? size : 0, 0);
+        rrpv.assign(policy == TLB_NRU || policy == TLB_SRRIP ? size : 0, 0);
     }
-    // All present pages have been used recently, set all page entry used flags to false
-    for (size_t i = 0; i < PTABLE_SIZE; i++) { pg_table[i].is_used = false; }
-    for (size_t i = 0; i < PTABLE_SIZE; i++) {
-        page_node& r = pg_table[i];
-        if (!r.is_used && r.is_present) { return i; }
+    size_t set_of(size_t tag) { return tag & (sets - 1); }
+    int lookup(size_t tag) {          // index holding tag, or -1
+        size_t base = set_of(tag) * ways;
+        int way = probe_tlb_set(tags.data() + base, ways, (uint64_t)tag);
+        return way < 0 ? -1 : (int)base + way;
     }
-    return (size_t)-1;
-}
+    void touch(int index) {           // entry used by a hit or a fill
+        if (repl == TLB_LRU) {
+            stamp[index] = ++clock;
+        } else if (repl == TLB_PLRU) {
+            size_t set = index / ways, way = index % ways;
+            unsigned char* t = tree.data() + set * ways;
+            for (size_t node = 1, half = ways / 2; half > 0; half /= 2) {
+                bool upper = (way & half) != 0;
+                t[node] = !upper;
+                node = 2 * node + upper;
+            }
+        } else if (repl == TLB_NRU) {
+            rrpv[index] = 1;
+            unsigned char* r = rrpv.data() + index / ways * ways;
+            if (std::find(r, r + ways, 0) == r + ways) {   // all recently used: start a new epoch
+                std::fill(r, r + ways, 0);
+                rrpv[index] = 1;
+            }
+        } else if (repl == TLB_SRRIP) {
+            rrpv[index] = 0;
+        }
+    }
+    size_t victim(size_t set) {       // way to fill in set
+        size_t base = set * ways;
+        if (repl == TLB_FIFO) {
+            size_t way = fill[set];
+            fill[set] = (fill[set] + 1) % ways;
+            return way;
+        }
+        for (size_t w = 0; w < ways; w++) {
+            if (tags[base + w] == TLB_INVALID_TAG) { return w; }
+        }
+        if (repl == TLB_LRU) {
+            size_t way = 0;
+            for (size_t w = 1; w < ways; w++) {
+                if (stamp[base + w] < stamp[base + way]) { way = w; }
+            }
+            return way;
+        }
+        if (repl == TLB_PLRU) {
+            const unsigned char* t = tree.data() + base;
+            size_t node = 1;
+            while (node < ways) { node = 2 * node + t[node]; }
+            return node - ways;
+        }
+        if (repl == TLB_NRU) {
+            const unsigned char* r = rrpv.data() + base;
+            return (size_t)(std::find(r, r + ways, 0) - r) % ways;
+        }
+        if (repl == TLB_SRRIP) {      // the first distant entry, ageing the set until there is one
+            unsigned char* r = rrpv.data() + base;
+            for (;;) {
+                for (size_t w = 0; w < ways; w++) {
+                    if (r[w] >= SRRIP_MAX) { return w; }
+                }
+                for (size_t w = 0; w < ways; w++) { ++r[w]; }
+            }
+        }
+        seed ^= seed << 13;  seed ^= seed >> 7;  seed ^= seed << 17;   // xorshift64
+        return seed % ways;
+    }
+    page_node insert(page_node entry) {   // the entry it displaced comes back, not present if none
+        size_t set = set_of(entry.npage);
+        int index = (int)(set * ways + victim(set));
+        page_node out = entries[index];
+        add(index, entry);
+        if (repl == TLB_SRRIP) { rrpv[index] = SRRIP_MAX - 1; } else { touch(index); }
+        return out;
+    }
+    void invalidate(size_t tag) {     // drop a stale translation
+        int index = lookup(tag);
+        if (index >= 0) { remove(index); }
+    }
+    size_t flush() {                  // drop every translation, returning how many were valid
+        size_t valid = 0;
+        for (size_t i = 0; i < size; i++) {
+            if (tags[i] != TLB_INVALID_TAG) { remove((int)i);  ++valid; }
+        }
+        return valid;
+    }
+    void add(int index, page_node entry);
+    void remove(int index);
+};
+
+// A huge page covers an aligned region of `pages` base pages. Frames stay base-page
+// sized: a region is promoted once all of its pages are resident and it has been
+// referenced promote_refs times, and demoted when any of them is evicted. While it is
+// promoted one entry in that size's TLB translates the whole region.
+struct huge_region {
+    size_t resident;    // pages of the region in memory
+    size_t refs;        // references since the region was last demoted or emptied
+    bool promoted;
+};
 
-int check_tlb(size_t page) {
-    for (int i = 0; i < TLB_SIZE; i++) {
-        if (tlb[i].npage == page) { return i; }
+struct huge_size {
+    size_t pages = 0;
+    unsigned shift = 0;                                // log2(pages): page >> shift is the region
+    tlb_array tlb;
+    std::unordered_map<size_t, huge_region> regions;   // regions with a resident page
+    size_t promotions = 0, demotions = 0;
+};
+
+const char* tlbpf_names[] = { "none", "sequential", "stride", "distance" };   // indexed by TLBPF_*
+
+struct tlbpf_row {
+    bool valid;
+    long long distance;
+    long long next[TLBPF_SLOTS];   // distances seen right after it, 0 for an empty slot
+};
+
+// Prefetches translations when a reference misses every TLB and walks the page table,
+// and when it first uses a prefetched translation: that use stands for the miss the
+// prefetch saved, so the predictors train on it and the next prefetch follows. Predicted
+// pages are walked too, and those resident get their translation installed, in the TLB
+// itself or in a small fully associative buffer looked up on an L1 miss. A prediction
+// never faults: a page that is not resident is dropped.
+struct tlb_prefetcher {
+    simulator& sim;
+    tlb_array buffer;                   // --tlb-prefetch-buffer, size 0 when prefetches fill the TLB
+    std::unordered_set<size_t> pending; // prefetched into the TLB, not used yet
+    size_t last = 0;                    // previous missing page
+    long long last_distance = 0;        // ... and the distance that led to it
+    bool started = false;
+    tlbpf_row rows[TLBPF_ROWS] = {};
+
+    tlb_prefetcher(simulator& s) : sim(s) {}
+
+    tlbpf_row& row(long long distance) { return rows[(size_t)distance & (TLBPF_ROWS - 1)]; }
+    void learn(long long distance, long long next) {   // next followed distance: make it the first prediction
+        tlbpf_row& r = row(distance);
+        if (!r.valid || r.distance != distance) { r = { true, distance, {} }; }
+        int k = 0;
+        while (k < TLBPF_SLOTS - 1 && r.next[k] != next) { k++; }
+        for (; k > 0; k--) { r.next[k] = r.next[k - 1]; }
+        r.next[0] = next;
     }
-    return -1;
+
+    bool issue(size_t page, long long distance);
+    bool buffer_hit(size_t& frame, size_t page);
+    void used(size_t page, size_t frame);
+    void on_miss(size_t page);
+    void train(size_t page);
+};
+
+// One simulated core in --cores mode: its own thread, trace stream and TLB. Other cores
+// reach it only through the inbox, as shootdown IPIs naming pages to invalidate; the core
+// handles them between references, or while it waits for the memory lock.
+struct core_state {
+    size_t id = 0;
+    tlb_array tlb;
+    std::vector<size_t> addresses;
+    std::vector<int> values;              // expected value per reference, INT_MIN when there is none to check
+    std::vector<unsigned char> ops;       // OP_* per reference, empty when every one reads
+    std::vector<size_t> accessed;         // frames hit in the TLB since the core last held the memory lock
+    std::mutex inbox_lock;
+    std::vector<size_t> inbox;
+    std::atomic<size_t> pending{0};       // IPIs posted and not yet handled
+    std::atomic<bool> done{false};
+    size_t refs = 0, hits = 0, walks = 0, faults = 0, failed = 0;
+    size_t dirty_writes = 0;              // writes through a TLB entry already dirty, which need no lock
+    size_t shootdowns = 0, ipis_sent = 0, ipis_received = 0;
+
+    void post(size_t page) {
+        std::lock_guard<std::mutex> hold(inbox_lock);
+        inbox.push_back(page);
+        pending.fetch_add(1, std::memory_order_release);
+    }
+    void service() {                      // take the interrupts: drop the translations, then ack
+        std::lock_guard<std::mutex> hold(inbox_lock);
+        for (size_t page : inbox) { tlb.invalidate(page); }
+        ipis_received += inbox.size();
+        pending.fetch_sub(inbox.size(), std::memory_order_release);
+        inbox.clear();
+    }
+};
+
+struct process_info {
+    uint32_t pid;
+    size_t refs, faults, walks;
+};
+
+// One simulation: its memory, page and frame tables, TLB, replacement policy, prefetcher
+// and counters. Simulators share only the command-line options and the mapped backing
+// store, both read-only while they run, so any number of them can run on separate threads.
+struct simulator {
+    sim_options options;    // this run's configuration, shadowing the command-line one
+    sim_stats stats = {};
+    size_t nframes;
+
+    std::vector<char> ram;
+    std::vector<const char*> frame_data;  // where each frame's bytes live: its slot in ram, or its page in backing_map
+    std::vector<frame_node> frame_table;  // owner of every physical frame, kept in step with pg_table
+    replace_policy* policy = nullptr;
+    std::vector<page_table*> tables;      // one per address space, indexed by ASID
+    std::vector<process_info> procs;      // ... and what each process did
+    std::unordered_map<uint32_t, size_t> asids;   // process ID -> ASID, in order of first reference
+    size_t asid = 0;                      // running process
+    size_t switches = 0, flushed = 0;     // context switches, valid TLB entries they flushed
+    std::vector<core_state*> cores;       // --cores: the cores sharing this memory, empty otherwise
+    size_t running = 0;                   // ... the one holding the memory lock
+    std::vector<uint64_t> sharers;        // ... per frame, the cores whose TLB may translate to it
+    tlb_array tlb;                        // L1
+    tlb_array stlb;                       // second level, size 0 when there is none
+    huge_size huge[HUGE_SIZES];           // options.huge_count of them, smallest first
+    stride_prefetcher prefetcher;
+    tlb_prefetcher tlbpf;
+    std::vector<char> page_buf, cluster_buf;   // backing-store reads: one page, a fault-around cluster
+    std::map<size_t, std::vector<char>> wb_queue;   // dirty victims by backing-store page, so runs come out in order
+    std::vector<char> wb_buf;             // one run of them being written
+    FILE* fbacking = nullptr;
+    const std::vector<size_t>* preloaded; // the whole trace, when a sweep holds it in memory for every simulator
+
+    size_t frames_used = 0, nrefs = 0, pg_faults = 0, tlb_hits = 0;
+    size_t failed_asserts = 0;
+    bool exit_on_failure = true;          // a single run gives up after a few wrong values, a sweep counts them
+
+    simulator(const sim_options& opts, const std::vector<size_t>* trace = nullptr);
+    ~simulator();
+
+    size_t page_of_frame(size_t frame) { return frame_table[frame].npage; }
+    size_t frame_of_page(size_t page) { return pte(page).frame_num; }
+    // A page key is (ASID << vpn_bits) | virtual page number, so TLB tags, frame owners and
+    // policies tell processes apart while each process keeps its own radix page table. The
+    // inverted table is one per physical memory, shared by every process and keyed by ASID.
+    size_t vpn(size_t page) { return page & options.max_page; }
+    size_t asid_of(size_t page) { return page >> options.vpn_bits; }
+    page_table& space(size_t page) {
+        page_table& t = *tables[options.inverted ? 0 : asid_of(page)];
+        t.select(asid_of(page));
+        return t;
+    }
+    page_table* new_table();
+    page_node& pte(size_t page) { return space(page).entry(vpn(page)); }
+    bool is_resident(size_t page) {   // without allocating page-table nodes
+        size_t steps = 0;
+        page_node* e = space(page).find(vpn(page), steps);
+        return e != nullptr && e->is_present;
+    }
+    bool page_walk(size_t page);
+
+    void initialize_pg_table_tlb();
+    void update_frame_ptable(size_t npage, size_t frame_num);
+    long long find_frame_ptable(size_t frame);
+    void resolve_speculation(size_t frame, bool used);
+    void tlb_hit(size_t& frame, size_t& page, int result);
+    void tlb_miss(size_t& frame, size_t& page);
+    bool stlb_hit(size_t& frame, size_t page);
+    void tlb_fill(page_node entry, bool from_stlb = false);
+    bool huge_hit(size_t& frame, size_t page);
+    bool huge_insert(size_t page);
+    void huge_reference(size_t page);
+    void unmap_frame(size_t frame);
+    void mark_dirty(size_t page);
+    void write_back(size_t page, size_t frame);
+    void flush_writeback();
+    void context_switch(uint32_t pid);
+    void shootdown(size_t frame, size_t page);
+    const char* read_pages(size_t first, size_t count, char* buf);
+    void fill_frame(size_t frame, const char* src);
+    void page_in(size_t page, size_t frame);
+    void fault_around(size_t page, size_t frame);
+    void page_fault(size_t& frame, size_t& page);
+    void check_address_value(size_t logic_add, size_t page, size_t offset, size_t physical_add,
+                             size_t& prev_frame, size_t frame, int val, int value, size_t o);
+    void run(trace_source* trace, value_source* expected);
+    void summarize();
+};
+
+void simulator::update_frame_ptable(size_t npage, size_t frame_num) {
+    page_node& e = space(npage).map(vpn(npage), frame_num);
+    if (!wb_queue.empty()) {     // still waiting for write-back: the queued copy is newer than the store, and stays dirty
+        auto q = wb_queue.find(vpn(npage));
+        if (q != wb_queue.end()) {
+            fill_frame(frame_num, q->second.data());
+            e.is_dirty = true;
+            wb_queue.erase(q);
+            ++stats.wb_reclaimed;
+        }
+    }
+    frame_table[frame_num].npage = npage;
+    frame_table[frame_num].is_mapped = true;
+    for (unsigned s = 0; s < options.huge_count; s++) { ++huge[s].regions[npage >> huge[s].shift].resident; }
 }
 
-void open_files(FILE*& fadd, FILE*& fcorr, FILE*& fback) { 
-    fadd = fopen("addresses.txt", "r");
-    if (fadd == NULL) { fprintf(stderr, "Could not open file: 'addresses.txt'\n");  exit(FILE_ERROR); }
+bool simulator::page_walk(size_t page) {  // TLB miss: is page resident? counts the nodes the walk reads
+    ++stats.walks;
+    page_node* e = space(page).find(vpn(page), stats.walk_steps);
+    return e != nullptr && e->is_present;
+}
 
-    fcorr = fopen("correct.txt", "r");
-    if (fcorr == NULL) { fprintf(stderr, "Could not open file: 'correct.txt'\n");  exit(FILE_ERROR); }
+long long simulator::find_frame_ptable(size_t frame) {  // page owning frame, or -1
+    if (frame >= nframes || !frame_table[frame].is_mapped) { return -1; }
+    return (long long)frame_table[frame].npage;
+}
 
-    fback = fopen("BACKING_STORE.bin", "rb");
+void open_files(FILE*& fback, bool writable = false) { 
+    fback = fopen("BACKING_STORE.bin", writable ? "r+b" : "rb");
     if (fback == NULL) { fprintf(stderr, "Could not open file: 'BACKING_STORE.bin'\n");  exit(FILE_ERROR); }
 }
-void close_files(FILE* fadd, FILE* fcorr, FILE* fback) { 
-    fclose(fadd);
-    fclose(fcorr);
+void map_backing_store(FILE* fback) {
+#if defined(HAVE_MMAP)
+    struct stat st;
+    if (fstat(fileno(fback), &st) != 0 || st.st_size == 0) {
+        fprintf(stderr, "Could not stat file: 'BACKING_STORE.bin'\n");  exit(FILE_ERROR);
+    }
+    backing_size = (size_t)st.st_size;
+    void* map = mmap(NULL, backing_size, PROT_READ, MAP_PRIVATE, fileno(fback), 0);
+    if (map == MAP_FAILED) { fprintf(stderr, "Could not mmap file: 'BACKING_STORE.bin'\n");  exit(FILE_ERROR); }
+    backing_map = (const char*)map;
+#else
+    fprintf(stderr, "Memory-mapped backing store is not supported on this platform\n");  exit(FILE_ERROR);
+#endif
+}
+
+void unmap_backing_store() {
+#if defined(HAVE_MMAP)
+    if (backing_map != nullptr) { munmap((void*)backing_map, backing_size); }
+#endif
+    backing_map = nullptr;
+    backing_size = 0;
+}
+
+void close_files(FILE* fback) { 
     fclose(fback);
 }
 
-void initialize_pg_table_tlb() { 
-    for (int i = 0; i < PTABLE_SIZE; ++i) {
-        pg_table[i].npage = (size_t)i;
-        pg_table[i].is_present = false;
-        pg_table[i].is_used = false;
+FILE* open_input(const char* path) {  // "-" is stdin
+    if (strcmp(path, "-") == 0) { return stdin; }
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) { fprintf(stderr, "Could not open file: '%s'\n", path);  exit(FILE_ERROR); }
+    return f;
+}
+
+bool is_digit(char c) { return (unsigned char)(c - '0') < 10; }
+
+// Text input is read through a window: a regular file is mmapped whole (the kernel pages
+// it in and drops it behind as we go), anything else - a pipe, "-" for stdin - is read
+// TEXT_CHUNK bytes at a time. Either way memory stays bounded.
+struct text_reader {
+    FILE* f = nullptr;
+    const char* data = nullptr;   // the window: unread input is [data + pos, data + len)
+    size_t pos = 0, len = 0;
+    bool eof = false;
+    bool is_mmapped = false;
+    std::vector<char> chunk;
+
+    text_reader(FILE* file) : f(file) {
+#if defined(HAVE_MMAP)
+        struct stat st;
+        if (f != stdin && fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+            if (map != MAP_FAILED) {
+                madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+                data = (const char*)map;
+                len = (size_t)st.st_size;
+                eof = is_mmapped = true;
+                return;
+            }
+        }
+#endif
+        chunk.resize(TEXT_CHUNK);
+        data = chunk.data();
+    }
+
+    ~text_reader() {
+#if defined(HAVE_MMAP)
+        if (is_mmapped) { munmap((void*)data, len); }
+#endif
+        if (f != stdin) { fclose(f); }
+    }
+
+    bool fill() {  // slide the unread tail to the front and read more; false once the input is exhausted
+        if (eof) { return false; }
+        memmove(chunk.data(), chunk.data() + pos, len - pos);
+        len -= pos;
+        pos = 0;
+        size_t n = fread(chunk.data() + len, 1, chunk.size() - len, f);
+        if (n == 0 && len < chunk.size()) { eof = true; }
+        len += n;
+        return n > 0;
+    }
+
+    bool have(size_t i) {  // is data[pos + i] available? (may slide the window)
+        while (pos + i >= len) {
+            if (!fill()) { return false; }
+        }
+        return true;
+    }
+
+    // Next integer in the input. Non-negative numbers may use all 64 bits, and come back
+    // as their two's-complement long long; callers take addresses back as size_t. If op
+    // is given it receives the letter following the number on the same line, lower-cased
+    // ('r', 'w', ...), or 0 when there is none. If tag is given, a number followed by
+    // ':' ("3:4096") is a tag for the number after it; *tag is -1 when there is none.
+    bool next(long long& value, char* op = nullptr, long long* tag = nullptr) {
+        for (;; ++pos) {
+            if (!have(0)) { return false; }
+            if (is_digit(data[pos])) { break; }
+            if (data[pos] == '-' && have(1) && is_digit(data[pos + 1])) { break; }
+        }
+        size_t n = 1;
+        while (have(n) && is_digit(data[pos + n])) { ++n; }
+        std::from_chars_result r;
+        if (data[pos] == '-') {
+            r = std::from_chars(data + pos, data + pos + n, value);
+        } else {
+            unsigned long long u = 0;
+            r = std::from_chars(data + pos, data + pos + n, u);
+            value = (long long)u;
+        }
+        if (r.ec != std::errc()) { fprintf(stderr, "Number out of range: '%.*s'\n", (int)n, data + pos);  exit(FILE_ERROR); }
+        pos = r.ptr - data;
+        if (tag != nullptr) {
+            *tag = -1;
+            if (have(0) && data[pos] == ':') {
+                long long t = value;
+                ++pos;
+                if (!next(value, op)) { return false; }
+                *tag = t;
+                return true;
+            }
+        }
+        if (op != nullptr) {
+            *op = 0;
+            while (have(0) && (data[pos] == ' ' || data[pos] == '\t' || data[pos] == ',')) { ++pos; }
+            if (have(0) && isalpha((unsigned char)data[pos])) { *op = (char)tolower((unsigned char)data[pos++]); }
+            if (have(0) && (isalnum((unsigned char)data[pos]) || data[pos] == '.')) {   // "0x1f", "12.5", "4096rw"
+                size_t k = 0;
+                while (have(k) && k < 32 && !isspace((unsigned char)data[pos + k])) { ++k; }
+                fprintf(stderr, "Not an address: '%llu%.*s%.*s'\n", (unsigned long long)value, *op != 0, op, (int)k, data + pos);
+                exit(FILE_ERROR);
+            }
+        }
+        return true;
+    }
+};
+
+struct value_source {   // expected values, one per reference
+    virtual ~value_source() {}
+    virtual bool next(int& value) = 0;   // false once they run out
+};
+
+struct value_stream : value_source {   // from correct.txt-style lines
+    text_reader in;
+
+    value_stream(const char* path) : in(open_input(path)) {}
+    bool next(int& value) override {  // "Virtual address: v Physical address: p Value: x" -> x
+        long long field[3];
+        for (long long& x : field) {
+            if (!in.next(x)) { return false; }
+        }
+        value = (int)field[2];
+        return true;
+    }
+};
+
+// Binary trace format (all integers little-endian):
+//   header, TRACE_HEADER_SIZE bytes:
+//     char[4] magic "MMTR", u16 version, u8 address bits, u8 flags (TRACE_HAS_OPS),
+//     u32 page size, u32 references per block, u64 total references, u64 reserved
+//   blocks, each independently decodable:
+//     u32 references, u32 payload bytes,
+//     payload: per reference, the zigzag-encoded difference from the previous address in
+//              the block (the first from 0) as an LEB128 varint; then, with TRACE_HAS_OPS,
+//              one bit per reference, 1 = write
+void put_le(unsigned char* p, uint64_t v, int bytes) { for (int i = 0; i < bytes; i++) { p[i] = (unsigned char)(v >> (8 * i)); } }
+
+uint64_t get_le(const unsigned char* p, int bytes) {
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; i++) { v |= (uint64_t)p[i] << (8 * i); }
+    return v;
+}
+
+uint64_t zigzag(int64_t v) { return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63); }
+int64_t unzigzag(uint64_t v) { return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+
+struct trace_header {
+    unsigned address_bits;
+    unsigned flags;
+    size_t page_size;
+    size_t block_refs;
+    uint64_t total_refs;
+};
+
+void write_trace_header(FILE* f, const trace_header& h) {
+    unsigned char raw[TRACE_HEADER_SIZE] = {};
+    memcpy(raw, TRACE_MAGIC, 4);
+    put_le(raw + 4, TRACE_VERSION, 2);
+    raw[6] = (unsigned char)h.address_bits;
+    raw[7] = (unsigned char)h.flags;
+    put_le(raw + 8, h.page_size, 4);
+    put_le(raw + 12, h.block_refs, 4);
+    put_le(raw + 16, h.total_refs, 8);
+    fwrite(raw, 1, sizeof(raw), f);
+}
+
+// A trace is consumed in batches, so the simulation never needs all of it in memory.
+struct trace_source {
+    std::vector<uint32_t> pids;   // process of each reference in the last batch; empty for a single-process trace
+    virtual ~trace_source() {}
+    virtual bool next_batch(std::vector<size_t>& addresses, std::vector<unsigned char>& ops) = 0;  // false at the end
+};
+
+// Decimal addresses, one per line, each optionally followed by r or w. A multi-process
+// trace prefixes addresses with a process ID ("3:4096 w"); untagged lines belong to process 0.
+struct text_trace : trace_source {
+    text_reader in;
+    bool tagged = false;
+
+    text_trace(FILE* f) : in(f) {}
+    bool next_batch(std::vector<size_t>& addresses, std::vector<unsigned char>& ops) override {
+        addresses.clear();
+        ops.clear();
+        pids.clear();
+        long long x, pid;
+        char op;
+        while (addresses.size() < TRACE_BLOCK_REFS && in.next(x, &op, &pid)) {
+            if (pid >= 0 && !tagged) {
+                tagged = true;
+                pids.assign(addresses.size(), 0);
+            }
+            if (tagged) { pids.push_back(pid >= 0 ? (uint32_t)pid : 0); }
+            addresses.push_back((size_t)x);
+            ops.push_back(op == 'w' ? OP_WRITE : OP_READ);
+        }
+        return !addresses.empty();
+    }
+};
+
+struct binary_trace : trace_source {  // streams a TRACE_MAGIC file one block at a time
+    FILE* f;
+    trace_header header;
+    std::vector<unsigned char> payload;
+
+    binary_trace(FILE* file, const unsigned char* raw) : f(file) {
+        header.address_bits = raw[6];
+        header.flags = raw[7];
+        header.page_size = (size_t)get_le(raw + 8, 4);
+        header.block_refs = (size_t)get_le(raw + 12, 4);
+        header.total_refs = get_le(raw + 16, 8);
+        if (header.page_size != options.page_size) {
+            fprintf(stderr, "Warning: trace was recorded with %zu-byte pages, simulating %zu\n", header.page_size, options.page_size);
+        }
+    }
+    ~binary_trace() { if (f != stdin) { fclose(f); } }
+
+    bool next_batch(std::vector<size_t>& addresses, std::vector<unsigned char>& ops) override {
+        unsigned char raw[8];
+        if (fread(raw, 1, sizeof(raw), f) != sizeof(raw)) { return false; }
+        size_t nrefs = (size_t)get_le(raw, 4), nbytes = (size_t)get_le(raw + 4, 4);
+        payload.resize(nbytes);
+        if (fread(payload.data(), 1, nbytes, f) != nbytes) { fprintf(stderr, "Truncated trace block\n");  exit(FILE_ERROR); }
+
+        addresses.resize(nrefs);
+        const unsigned char* p = payload.data();
+        const unsigned char* end = p + nbytes;
+        uint64_t addr = 0;
+        for (size_t i = 0; i < nrefs; i++) {
+            uint64_t v = 0;
+            for (int shift = 0; ; shift += 7) {
+                if (shift >= 64 || p == end) {   // more than ten bytes, or a varint cut off by the end of the block
+                    fprintf(stderr, "Corrupt trace block: reference %zu has a bad address encoding\n", i);  exit(FILE_ERROR);
+                }
+                unsigned char byte = *p++;
+                v |= (uint64_t)(byte & 0x7f) << shift;
+                if (byte < 0x80) { break; }
+            }
+            addr += (uint64_t)unzigzag(v);
+            addresses[i] = (size_t)addr;
+        }
+        ops.clear();
+        if (header.flags & TRACE_HAS_OPS) {
+            ops.resize(nrefs);
+            for (size_t i = 0; i < nrefs && p + i / 8 < end; i++) { ops[i] = (p[i / 8] >> (i % 8)) & 1; }
+        }
+        return nrefs > 0 || next_batch(addresses, ops);
+    }
+};
+
+struct memory_trace : trace_source {   // batches out of a trace already in memory, which may be shared
+    const std::vector<size_t>& all;
+    const std::vector<uint32_t>* all_pids;   // nullptr or empty for a single process
+    const std::vector<unsigned char>* all_ops;   // nullptr or empty when every reference reads
+    size_t pos = 0;
+
+    memory_trace(const std::vector<size_t>& addresses, const std::vector<uint32_t>* processes = nullptr,
+                 const std::vector<unsigned char>* operations = nullptr)
+        : all(addresses), all_pids(processes), all_ops(operations) {}
+    bool next_batch(std::vector<size_t>& addresses, std::vector<unsigned char>& ops) override {
+        size_t n = std::min((size_t)TRACE_BLOCK_REFS, all.size() - pos);
+        addresses.assign(all.begin() + pos, all.begin() + pos + n);
+        if (all_pids != nullptr && !all_pids->empty()) { pids.assign(all_pids->begin() + pos, all_pids->begin() + pos + n); }
+        ops.clear();
+        if (all_ops != nullptr && !all_ops->empty()) { ops.assign(all_ops->begin() + pos, all_ops->begin() + pos + n); }
+        pos += n;
+        return n > 0;
+    }
+};
+
+struct value_list : value_source {
+    const std::vector<int>& all;
+    size_t pos = 0;
+
+    value_list(const std::vector<int>& values) : all(values) {}
+    bool next(int& value) override {
+        if (pos == all.size()) { return false; }
+        value = all[pos++];
+        return true;
+    }
+};
+
+trace_source* open_trace(const char* path) {  // binary if the input starts with TRACE_MAGIC, text otherwise
+    FILE* f = open_input(path);
+    int c = getc(f);      // a text trace never starts with 'M', so one byte of lookahead works on pipes too
+    ungetc(c, f);
+    if (c != TRACE_MAGIC[0]) { return new text_trace(f); }
+
+    unsigned char raw[TRACE_HEADER_SIZE];
+    if (fread(raw, 1, sizeof(raw), f) != sizeof(raw) || memcmp(raw, TRACE_MAGIC, 4) != 0) {
+        fprintf(stderr, "Not a trace file: '%s'\n", path);  exit(FILE_ERROR);
+    }
+    if (get_le(raw + 4, 2) != TRACE_VERSION) { fprintf(stderr, "Unsupported trace version in '%s'\n", path);  exit(FILE_ERROR); }
+    return new binary_trace(f, raw);
+}
+
+void flush_trace_block(FILE* out, const std::vector<size_t>& addresses, const std::vector<unsigned char>& ops,
+                       bool with_ops, std::vector<unsigned char>& payload) {
+    payload.clear();
+    uint64_t prev = 0;
+    for (size_t a : addresses) {
+        uint64_t v = zigzag((int64_t)((uint64_t)a - prev));
+        prev = a;
+        while (v >= 0x80) { payload.push_back((unsigned char)(v | 0x80));  v >>= 7; }
+        payload.push_back((unsigned char)v);
+    }
+    if (with_ops) {
+        size_t base = payload.size();
+        payload.resize(base + (addresses.size() + 7) / 8, 0);
+        for (size_t i = 0; i < ops.size(); i++) { payload[base + i / 8] |= (unsigned char)(ops[i] << (i % 8)); }
+    }
+    unsigned char raw[8];
+    put_le(raw, addresses.size(), 4);
+    put_le(raw + 4, payload.size(), 4);
+    fwrite(raw, 1, sizeof(raw), out);
+    fwrite(payload.data(), 1, payload.size(), out);
+}
+
+void convert_trace(const char* in_path, const char* out_path) {
+    // Text to binary, streaming: a first pass finds the address width and whether any
+    // line carries an op ("r" read, "w" write after the address), the second encodes.
+    if (strcmp(in_path, "-") == 0) { fprintf(stderr, "--convert needs a file it can read twice, not stdin\n");  exit(ARGC_ERROR); }
+    uint64_t count = 0;
+    size_t max_address = 0;
+    bool with_ops = false;
+    {
+        text_reader in(open_input(in_path));
+        long long x, pid;
+        char op;
+        while (in.next(x, &op, &pid)) {
+            if (pid >= 0) { fprintf(stderr, "Binary traces do not carry process IDs: '%s'\n", in_path);  exit(ARGC_ERROR); }
+            ++count;
+            max_address = std::max(max_address, (size_t)x);
+            if (op == 'r' || op == 'w') { with_ops = true; }
+        }
+    }
+
+    FILE* out = fopen(out_path, "wb");
+    if (out == NULL) { fprintf(stderr, "Could not open file: '%s'\n", out_path);  exit(FILE_ERROR); }
+    unsigned bits = 1;
+    while (bits < 64 && (max_address >> bits) != 0) { ++bits; }
+    write_trace_header(out, { bits, with_ops ? (unsigned)TRACE_HAS_OPS : 0u, options.page_size, TRACE_BLOCK_REFS, count });
+
+    std::vector<size_t> block;
+    std::vector<unsigned char> block_ops, payload;
+    text_reader in(open_input(in_path));
+    long long x;
+    char op;
+    while (in.next(x, &op)) {
+        block.push_back((size_t)x);
+        block_ops.push_back(op == 'w' ? OP_WRITE : OP_READ);
+        if (block.size() == TRACE_BLOCK_REFS) {
+            flush_trace_block(out, block, block_ops, with_ops, payload);
+            block.clear();
+            block_ops.clear();
+        }
+    }
+    if (!block.empty()) { flush_trace_block(out, block, block_ops, with_ops, payload); }
+    long in_size = in.is_mmapped ? (long)in.len : ftell(in.f);
+    long out_size = ftell(out);
+    fclose(out);
+    printf("Converted %" PRIu64 " references (%u-bit addresses%s): %ld bytes -> %ld bytes (%1.2fx smaller)\n",
+           count, bits, with_ops ? ", with ops" : "", in_size, out_size,
+           out_size > 0 ? (double)in_size / out_size : 0.0);
+}
+
+page_table* simulator::new_table() {
+    if (options.inverted) { return new hashed_page_table(nframes); }
+    return new radix_page_table(options.vpn_bits, options.pt_levels);
+}
+
+void simulator::initialize_pg_table_tlb() { 
+    for (page_table* t : tables) { delete t; }
+    tables = { new_table() };
+    procs = { { 0, 0, 0, 0 } };
+    asids.clear();
+    asid = 0;
+    for (size_t i = 0; i < nframes; i++) {
+        frame_table[i].npage = (size_t)-1;
+        frame_table[i].is_mapped = false;
+        frame_table[i].speculative = SPEC_NONE;
+        frame_data[i] = ram.data() + i * options.page_size;
     }
-    for (int i = 0; i < TLB_SIZE; i++) {
-        tlb[i].npage = (size_t)-1;
-        tlb[i].is_present = false;
-        pg_table[i].is_used = false;
+    tlb.init(options.tlb_size, options.tlb_ways, options.tlb_repl);
+    stlb.init(options.stlb_size, options.stlb_ways, options.stlb_repl);
+    tlbpf.buffer.init(options.tlb_pf_buffer, options.tlb_pf_buffer);
+    tlbpf.pending.clear();
+    for (unsigned s = 0; s < options.huge_count; s++) {
+        huge[s] = huge_size();
+        huge[s].pages = options.huge_pages[s];
+        while (((size_t)1 << huge[s].shift) < huge[s].pages) { huge[s].shift++; }
+        huge[s].tlb.init(options.huge_tlb, options.huge_tlb);
     }
 }
 
-void summarize(size_t pg_faults, size_t tlb_hits) { 
-    printf("\nPage Fault Percentage: %1.3f%%", (double)pg_faults / 1000);
-    printf("\nTLB Hit Percentage: %1.3f%%\n\n", (double)tlb_hits / 1000);
-    printf("ALL logical ---> physical assertions PASSED!\n");
+double percent(size_t part, size_t whole) { return whole ? 100.0 * part / whole : 0.0; }
+
+std::string size_label(double bytes) {   // "4 KiB"
+    const char* units[] = { "B", "KiB", "MiB", "GiB", "TiB", "PiB" };
+    int u = 0;
+    for (; bytes >= 1024 && u < 5; u++) { bytes /= 1024; }
+    char buf[32];
+    snprintf(buf, sizeof buf, "%g %s", bytes, units[u]);
+    return buf;
+}
+
+void simulator::summarize() { 
+    printf("\nReplacement Policy: %s", options.policy_name);
+    printf("\nReferences: %zu", nrefs);
+    printf("\nPage Fault Percentage: %1.3f%% (%zu)", percent(pg_faults, nrefs), pg_faults);
+    printf("\nTLB Hit Percentage: %1.3f%% (%zu)\n\n", percent(tlb_hits, nrefs), tlb_hits);
+    size_t table_bytes = 0;
+    for (page_table* t : tables) { table_bytes += t->bytes; }
+    printf("Page Table: %u-bit addresses, %zu-byte pages, ", options.address_bits, options.page_size);
+    tables[0]->describe();
+    if (procs.size() > 1) { printf(options.inverted ? " shared by %zu address spaces" : " x %zu address spaces", procs.size()); }
+    printf(": %zu walks reading %zu %s (%1.2f per TLB miss), %zu bytes (flat table: %.4g bytes)\n\n",
+           stats.walks, stats.walk_steps, options.inverted ? "cache lines" : "nodes",
+           stats.walks ? (double)stats.walk_steps / stats.walks : 0.0, table_bytes,
+           ((double)options.max_page + 1) * sizeof(page_node) * procs.size());
+    if (!cores.empty()) {
+        size_t shootdowns = 0, ipis = 0;
+        for (core_state* c : cores) { shootdowns += c->shootdowns;  ipis += c->ipis_sent; }
+        double cost = (double)ipis * (options.ipi_cycles[0] + options.ipi_cycles[1]);
+        printf("Cores: %zu, sharing one page table and %zu frames: %zu shootdowns sending %zu IPIs (%1.2f each), "
+               "%.0f cycles (%1.3f per reference, %u per IPI sent, %u received)\n", cores.size(), nframes, shootdowns, ipis,
+               shootdowns ? (double)ipis / shootdowns : 0.0, cost, nrefs ? cost / nrefs : 0.0, options.ipi_cycles[0], options.ipi_cycles[1]);
+        for (core_state* c : cores) {
+            printf("  core %-3zu %10zu references %10zu TLB hits (%1.3f%%) %8zu faults %8zu shootdowns %8zu IPIs received\n",
+                   c->id, c->refs, c->hits, percent(c->hits, c->refs), c->faults, c->shootdowns, c->ipis_received);
+        }
+        printf("\n");
+    }
+    if (!asids.empty()) {
+        printf("Processes: %zu, %s, %zu context switches, ", procs.size(),
+               options.quantum ? ("quantum " + std::to_string(options.quantum)).c_str() : "trace order", switches);
+        if (options.tlb_flush) {
+            printf("TLBs flushed on each (%zu entries dropped)\n", flushed);
+        } else {
+            printf("ASID-tagged TLB entries kept across them\n");
+        }
+        for (size_t a = 0; a < procs.size() && a < SHOW_PROCESSES; a++) {
+            const process_info& p = procs[a];
+            printf("  pid %-6" PRIu32 " asid %-4zu %10zu references %10zu faults (%1.3f%%) %10zu TLB misses (%1.3f%%)\n",
+                   p.pid, a, p.refs, p.faults, percent(p.faults, p.refs), p.walks, percent(p.walks, p.refs));
+        }
+        if (procs.size() > SHOW_PROCESSES) { printf("  ... %zu more\n", procs.size() - SHOW_PROCESSES); }
+        printf("\n");
+    }
+    if (stlb.size || options.show_latency || procs.size() > 1) {
+        size_t huge_hits = 0;
+        for (unsigned s = 0; s < options.huge_count; s++) { huge_hits += huge[s].tlb.hits; }
+        size_t l1_misses = nrefs - tlb.hits - huge_hits - tlbpf.buffer.hits;   // the prefetch buffer is looked up beside L1
+        double cycles = (double)nrefs * options.latency[0] + (double)stats.walk_steps * options.latency[2];
+        if (stlb.size) { cycles += (double)l1_misses * options.latency[1]; }
+        printf("TLB Levels: L1 %zu entries, %zu-way %s: %zu hits (%1.3f%%)", tlb.size, tlb.ways, tlb_repl_names[tlb.repl],
+               tlb.hits, percent(tlb.hits, nrefs));
+        if (stlb.size) {
+            printf("; STLB (%s) %zu entries, %zu-way %s: %zu hits (%1.3f%% of L1 misses)", options.stlb_exclusive ? "exclusive" : "inclusive",
+                   stlb.size, stlb.ways, tlb_repl_names[stlb.repl], stlb.hits, percent(stlb.hits, l1_misses));
+        }
+        printf("\nTranslation: %.0f cycles, %1.3f per reference (L1 %u, STLB %u, %u per walk step)\n\n",
+               cycles, nrefs ? cycles / nrefs : 0.0, options.latency[0], options.latency[1], options.latency[2]);
+    }
+    if (options.huge_count) {
+        double reach = (double)tlb.size * options.page_size;
+        printf("TLB Reach: %s base TLB: %zu entries, %s, %zu hits (%1.3f%%)\n", size_label((double)options.page_size).c_str(),
+               tlb.size, size_label(reach).c_str(), tlb.hits, percent(tlb.hits, nrefs));
+        for (unsigned s = 0; s < options.huge_count; s++) {
+            huge_size& h = huge[s];
+            double bytes = (double)h.pages * options.page_size;
+            reach += h.tlb.size * bytes;
+            printf("           %s TLB: %zu entries, %s, %zu hits (%1.3f%%), %zu promotions, %zu demotions, %zu huge now\n",
+                   size_label(bytes).c_str(), h.tlb.size, size_label(h.tlb.size * bytes).c_str(), h.tlb.hits,
+                   percent(h.tlb.hits, nrefs), h.promotions, h.demotions, h.promotions - h.demotions);
+        }
+        printf("           total %s, %zu page-table walks\n\n", size_label(reach).c_str(), stats.walks);
+    }
+    if (options.tlb_prefetch != TLBPF_NONE) {
+        std::string where = tlbpf.buffer.size ? std::to_string(tlbpf.buffer.size) + "-entry buffer" : "into the TLB";
+        printf("TLB Prefetcher (%s, %s): %zu walks reading %zu %s, %zu translations installed, %zu used "
+               "(accuracy %1.3f%%, coverage %1.3f%% of misses)\n\n", tlbpf_names[options.tlb_prefetch], where.c_str(),
+               stats.tlbpf_walks, stats.tlbpf_steps, options.inverted ? "cache lines" : "nodes", stats.tlbpf_filled,
+               stats.tlbpf_useful, percent(stats.tlbpf_useful, stats.tlbpf_filled),
+               percent(stats.tlbpf_useful, stats.tlbpf_useful + stats.walks));
+    }
+    if (stats.writes || options.write_back) {
+        size_t dirty = 0;
+        for (size_t f = 0; f < frames_used; f++) {
+            if (frame_table[f].is_mapped && pte(frame_table[f].npage).is_dirty) { ++dirty; }
+        }
+        printf("Write-Back (%zu-page queue, %s): %zu writes, %zu PTE dirty-bit updates, %zu pages dirtied, "
+               "%zu still dirty in memory\n", options.wb_batch, options.write_back ? "to the backing store" : "modelled",
+               stats.writes, stats.dirty_updates, stats.dirtied, dirty);
+        printf("  evictions: %zu clean, %zu dirty (%1.3f%%); %zu pages written in %zu requests "
+               "(%1.2f pages each), %zu bytes; %zu faulted back from the queue unwritten\n\n", stats.clean_evictions, stats.dirty_evictions,
+               percent(stats.dirty_evictions, stats.clean_evictions + stats.dirty_evictions), stats.wb_pages,
+               stats.wb_writes, stats.wb_writes ? (double)stats.wb_pages / stats.wb_writes : 0.0,
+               stats.wb_pages * options.page_size, stats.wb_reclaimed);
+    }
+    if (options.cluster > 1) {
+        printf("Fault-Around (%zu pages): %zu backing store %s, %zu pages read ahead, %zu used, %zu evicted unused\n\n",
+               options.cluster, stats.pagein_reads, options.pagein == PAGEIN_READ ? "reads" : "requests through the mapping",
+               stats.prefetched, stats.prefetch_used, stats.prefetch_wasted);
+    }
+    if (options.prefetch) {
+        size_t resolved = stats.pf_useful + stats.pf_useless;
+        printf("Stride Prefetcher: %zu prefetched, %zu useful, %zu useless (accuracy %1.3f%%), "
+               "%zu evictions, %zu pollution faults\n\n",
+               stats.pf_issued, stats.pf_useful, stats.pf_useless,
+               percent(stats.pf_useful, resolved), stats.pf_evictions, stats.pf_pollution);
+    }
+    if (options.verify && failed_asserts == 0) { printf("ALL logical ---> physical assertions PASSED!\n"); }
     printf("\n\t\t...done.\n");
 }
 
-void tlb_add(int index, page_node entry) {
-    if (index < 0 || index >= TLB_SIZE) {
+void tlb_array::add(int index, page_node entry) {
+    if (index < 0 || index >= (int)size) {
         // Index out of bounds, handle error accordingly
         fprintf(stderr, "Error: TLB index out of bounds\n");
         return;
     }
 
     // Replace or add the entry at the specified index
-    tlb[index] = entry;
+    entries[index] = entry;
+    tags[index] = entry.is_present ? (uint64_t)entry.npage : TLB_INVALID_TAG;
 }
 
-void tlb_remove(int index) {
-    if (index < 0 || index >= TLB_SIZE) {
+void tlb_array::remove(int index) {
+    if (index < 0 || index >= (int)size) {
         // Index out of bounds, handle error accordingly
         fprintf(stderr, "Error: TLB index out of bounds\n");
         return;
     }
 
     // Set the TLB entry at the specified index as not present
-    tlb[index].is_present = false;
+    entries[index].is_present = false;
 
     // Optional: Clean up or reset other fields
-    tlb[index].npage = -1;
-    tlb[index].frame_num = -1;
+    entries[index].npage = -1;
+    entries[index].frame_num = -1;
+    tags[index] = TLB_INVALID_TAG;
+}
+
+void simulator::resolve_speculation(size_t frame, bool used) {  // a page loaded ahead of demand was referenced or evicted
+    frame_node& f = frame_table[frame];
+    if (f.speculative == SPEC_AROUND) {
+        ++(used ? stats.prefetch_used : stats.prefetch_wasted);
+    } else if (f.speculative == SPEC_STRIDE) {
+        ++(used ? stats.pf_useful : stats.pf_useless);
+        prefetcher.feedback(used);
+    }
+    f.speculative = SPEC_NONE;
 }
 
-void tlb_hit(size_t& frame, size_t& page, size_t& tlb_hits, int result) {
-    if (result < 0 || result >= TLB_SIZE) {
+void simulator::tlb_hit(size_t& frame, size_t& page, int result) {
+    if (result < 0 || result >= (int)tlb.size) {
         // Result index out of bounds, handle error accordingly
         fprintf(stderr, "Error: TLB hit index out of bounds\n");
         return;
     }
 
     // Update the frame number with the one found in the TLB entry
-    frame = tlb[result].frame_num;
+    frame = tlb.entries[result].frame_num;
 
     // Increment the TLB hits count
     tlb_hits++;
+    tlb.hits++;
+    tlb.touch(result);
 
-    // Optional: Update LRU information if using LRU policy
-    // This would involve moving the accessed entry to a more 'recently used' position.
+    pte(page).is_used = true;  // referenced
+
+    policy->on_access(frame);
+    if (!tlbpf.pending.empty()) { tlbpf.used(page, frame); }
 }
 
-void tlb_miss(size_t& frame, size_t& page, size_t& tlb_track) {
+void simulator::tlb_miss(size_t& frame, size_t& page) {
     // Check if page is in the page table and update frame
-    if (pg_table[page].is_present) {
-        frame = pg_table[page].frame_num;
+    page_node& e = pte(page);
+    if (e.is_present) {
+        frame = e.frame_num;
+        policy->on_access(frame);
+        if (frame_table[frame].speculative != SPEC_NONE) { resolve_speculation(frame, true); }  // first reference
     } else {
         // Handle error or page fault if page is not in the page table
         fprintf(stderr, "Error: Page not found in page table during TLB miss\n");
@@ -179,107 +1539,1013 @@ void tlb_miss(size_t& frame, size_t& page, size_t& tlb_track) {
     new_entry.frame_num = frame;
     new_entry.is_present = true;
 
-    // Update the TLB with the new entry
-    // Assuming tlb_track keeps track of the next TLB index to update
-    tlb_add(tlb_track % TLB_SIZE, new_entry);
+    new_entry.is_used = false;
+    new_entry.is_dirty = e.is_dirty;
 
-    // Update tlb_track for the next entry
-    tlb_track = (tlb_track + 1) % TLB_SIZE;
-}
+    e.is_used = true;  // referenced
 
-void fifo_replace_page(size_t& frame) {
-    static size_t next_frame_to_replace = 0;
+    // Update the TLB with the new entry, replacing round-robin within its set
+    if (!huge_insert(page)) { tlb_fill(new_entry); }
+}
 
-    // Check if the frame to be replaced is valid
-    if (next_frame_to_replace >= NFRAMES) {
-        fprintf(stderr, "Error: Invalid frame index for replacement\n");
+void simulator::tlb_fill(page_node entry, bool from_stlb) {  // install a translation in L1, keeping the STLB in step
+    entry.is_dirty = pte(entry.npage).is_dirty;   // an STLB or prefetched copy may predate the first write
+    if (!cores.empty()) {       // the running core's private TLB
+        page_node out = cores[running]->tlb.insert(entry);
+        if (out.is_present) { sharers[out.frame_num] &= ~((uint64_t)1 << running); }
+        sharers[entry.frame_num] |= (uint64_t)1 << running;
         return;
     }
-
-    // Identify the page currently occupying the frame
-    int page_to_replace = find_frame_ptable(next_frame_to_replace);
-    if (page_to_replace == -1) {
-        fprintf(stderr, "Error: No page found in frame to replace\n");
-        return;
+    page_node out = tlb.insert(entry);
+    if (stlb.size == 0) { return; }
+    if (options.stlb_exclusive) {             // the STLB holds what L1 lets go of
+        if (out.is_present) { stlb.insert(out); }
+    } else if (!from_stlb) {                  // inclusive: both levels fill, and the STLB evicts from L1 too
+        page_node gone = stlb.insert(entry);
+        if (gone.is_present) { tlb.invalidate(gone.npage); }
     }
+}
 
-    // Update the page table to indicate the page is no longer in a frame
-    pg_table[page_to_replace].is_present = false;
+bool simulator::stlb_hit(size_t& frame, size_t page) {  // L1 missed: the STLB may still hold the translation
+    int index = stlb.lookup(page);
+    if (index < 0) { return false; }
+    page_node e = stlb.entries[index];
+    ++stlb.hits;
+    ++tlb_hits;
+    frame = e.frame_num;
+    pte(page).is_used = true;
+    policy->on_access(frame);
+    if (options.stlb_exclusive) { stlb.remove(index); } else { stlb.touch(index); }
+    tlb_fill(e, true);
+    if (!tlbpf.pending.empty()) { tlbpf.used(page, frame); }   // after the fill: it may prefetch, moving STLB entries
+    return true;
+}
 
-    // Assign the frame number to the frame variable
-    frame = next_frame_to_replace;
+bool simulator::huge_hit(size_t& frame, size_t page) {  // a huge-page TLB covers page, largest size first
+    for (unsigned s = options.huge_count; s-- > 0; ) {
+        huge_size& h = huge[s];
+        int index = h.tlb.lookup(page >> h.shift);
+        if (index < 0) { continue; }
+        h.tlb.touch(index);
+        ++h.tlb.hits;
+        ++tlb_hits;
+        frame = frame_of_page(page);   // the region's frames are not contiguous here, so its PTE stands in for base + offset
+        pte(page).is_used = true;
+        policy->on_access(frame);
+        if (frame_table[frame].speculative != SPEC_NONE) { resolve_speculation(frame, true); }
+        return true;
+    }
+    return false;
+}
 
-    // Update the next frame to replace for the next call
-    next_frame_to_replace = (next_frame_to_replace + 1) % NFRAMES;
+bool simulator::huge_insert(size_t page) {  // after a walk: the largest promoted region holding page takes the entry
+    for (unsigned s = options.huge_count; s-- > 0; ) {
+        huge_size& h = huge[s];
+        auto it = h.regions.find(page >> h.shift);
+        if (it == h.regions.end() || !it->second.promoted) { continue; }
+        h.tlb.insert({ page >> h.shift, NIL_FRAME, true, false, false });
+        return true;
+    }
+    return false;
 }
 
-void lru_replace_page(size_t& frame) {
-    size_t least_recently_used_time = SIZE_MAX;
-    size_t lru_page_index = -1;
+void simulator::huge_reference(size_t page) {  // page is resident: promote its regions once they are full and hot
+    for (unsigned s = 0; s < options.huge_count; s++) {
+        huge_size& h = huge[s];
+        huge_region& r = h.regions[page >> h.shift];
+        ++r.refs;
+        if (!r.promoted && r.resident == h.pages && r.refs >= (options.promote_refs ? options.promote_refs : h.pages)) {
+            r.promoted = true;
+            ++h.promotions;
+        }
+    }
+}
 
-    // Iterate over the page table to find the least recently used page
-    for (size_t i = 0; i < PTABLE_SIZE; i++) {
-        if (pg_table[i].is_present && pg_table[i].is_used < least_recently_used_time) {
-            least_recently_used_time = pg_table[i].is_used;
-            lru_page_index = i;
+void simulator::unmap_frame(size_t frame) {  // evict whatever page owns frame: page table, TLB and frame table
+    long long npage = find_frame_ptable(frame);
+    if (npage < 0) { return; }
+    if (pte((size_t)npage).is_dirty) { write_back((size_t)npage, frame); } else { ++stats.clean_evictions; }
+    space((size_t)npage).unmap(vpn((size_t)npage));
+    tlb.invalidate((size_t)npage);   // drop the stale translation
+    if (stlb.size) { stlb.invalidate((size_t)npage); }
+    if (tlbpf.buffer.size) { tlbpf.buffer.invalidate((size_t)npage); }
+    if (!cores.empty()) { shootdown(frame, (size_t)npage); }
+    for (unsigned s = 0; s < options.huge_count; s++) {   // and split any huge page it was part of
+        huge_size& h = huge[s];
+        auto it = h.regions.find((size_t)npage >> h.shift);
+        if (it->second.promoted) {
+            it->second.promoted = false;
+            it->second.refs = 0;
+            ++h.demotions;
+            h.tlb.invalidate(it->first);
         }
+        if (--it->second.resident == 0) { h.regions.erase(it); }
     }
+    frame_table[frame].is_mapped = false;
+    if (frame_table[frame].speculative != SPEC_NONE) { resolve_speculation(frame, false); }
+}
 
-    if (lru_page_index == -1) {
-        fprintf(stderr, "Error: No page found for LRU replacement\n");
+// A write: only the first one through a TLB entry has to update the PTE. L1 entries take
+// the dirty bit from the PTE when installed, so a refill from the STLB or the prefetch
+// buffer doesn't bring back a clean copy. A huge-page entry stands for many PTEs, so a
+// write through one updates its page's PTE only if that is still clean.
+void simulator::mark_dirty(size_t page) {
+    ++stats.writes;
+    tlb_array& l1 = cores.empty() ? tlb : cores[running]->tlb;
+    int index = l1.lookup(page);
+    if (index >= 0 && l1.entries[index].is_dirty) { return; }
+    page_node& e = pte(page);
+    if (index >= 0) {
+        l1.entries[index].is_dirty = true;
+    } else if (e.is_dirty) {
         return;
     }
-
-    // Replace the least recently used page
-    frame = pg_table[lru_page_index].frame_num;
-    pg_table[lru_page_index].is_present = false;
+    ++stats.dirty_updates;
+    if (!e.is_dirty) {
+        e.is_dirty = true;
+        ++stats.dirtied;
+    }
 }
 
-void page_fault(size_t& frame, size_t& page, size_t& frames_used, size_t& pg_faults, 
-                size_t& tlb_track, FILE* fbacking) {  
-    unsigned char buf[FRAME_SIZE];
-    memset(buf, 0, sizeof(buf));
-    bool is_memfull = frames_used >= NFRAMES;
-
-    ++pg_faults;
+// A dirty victim: queue a copy, the frame is about to be reused. Processes page in from
+// the same store, so the same page of two address spaces shares one slot in the queue.
+void simulator::write_back(size_t page, size_t frame) {
+    ++stats.dirty_evictions;
+    wb_queue[vpn(page)].assign(frame_data[frame], frame_data[frame] + options.page_size);
+    if (wb_queue.size() >= options.wb_batch) { flush_writeback(); }
+}
 
-    if (is_memfull) {
-        // Memory is full, we need to replace a page
-#if REPLACE_POLICY == FIFO
-        fifo_replace_page(frame);
-#elif REPLACE_POLICY == LRU
-        lru_replace_page(frame);
+// The queue is sorted by backing-store page, so each run of consecutive pages goes out
+// as one sequential write. The store never grows: whatever lies past its end is dropped,
+// as reads there return zeros anyway.
+void simulator::flush_writeback() {
+    for (auto it = wb_queue.begin(); it != wb_queue.end(); ) {
+        size_t first = it->first, count = 0;
+        wb_buf.clear();
+        for (; it != wb_queue.end() && it->first == first + count; ++it, ++count) {
+            wb_buf.insert(wb_buf.end(), it->second.begin(), it->second.end());
+        }
+        ++stats.wb_writes;
+        stats.wb_pages += count;
+        if (!options.write_back) { continue; }
+        size_t pos = first * options.page_size, len = wb_buf.size();
+#if defined(HAVE_MMAP)
+        struct stat st;
+        if (fstat(fileno(fbacking), &st) != 0) { fprintf(stderr, "Could not stat file: 'BACKING_STORE.bin'\n");  exit(FILE_ERROR); }
+        if (pos >= (size_t)st.st_size) { continue; }
+        len = std::min(len, (size_t)st.st_size - pos);
+        if (pwrite(fileno(fbacking), wb_buf.data(), len, (off_t)pos) != (ssize_t)len) {
+            fprintf(stderr, "Could not write file: 'BACKING_STORE.bin'\n");  exit(FILE_ERROR);
+        }
+#else
+        fseek(fbacking, 0, SEEK_END);
+        size_t end = (size_t)ftell(fbacking);
+        if (pos >= end) { continue; }
+        len = std::min(len, end - pos);
+        fseek(fbacking, pos, SEEK_SET);
+        if (fwrite(wb_buf.data(), 1, len, fbacking) != len) { fprintf(stderr, "Could not write file: 'BACKING_STORE.bin'\n");  exit(FILE_ERROR); }
+        fflush(fbacking);
 #endif
-    } else {
-        // Memory is not full, use the next available frame
-        frame = frames_used;
     }
+    wb_queue.clear();
+}
 
-    // Load the page into RAM at the frame location
-    fseek(fbacking, page * FRAME_SIZE, SEEK_SET);
-    fread(buf, FRAME_SIZE, 1, fbacking);
-
-    // Copy the page into the frame
-    memcpy(ram + (frame * FRAME_SIZE), buf, FRAME_SIZE);
-
-    // Update the page table with the new frame
-    update_frame_ptable(page, frame);
-
-    // Add the page to the TLB
-    tlb_add(tlb_track % TLB_SIZE, {page, frame, true, false}); // Assuming TLB_SIZE is the size of the TLB
-    tlb_track = (tlb_track + 1) % TLB_SIZE;
-
-    if (!is_memfull) {
-        ++frames_used;
+// The running core evicts page from frame: every other core whose TLB may hold the
+// translation gets an IPI, and the frame is reused only once all of them have acked.
+void simulator::shootdown(size_t frame, size_t page) {
+    core_state& self = *cores[running];
+    uint64_t targets = sharers[frame] & ~((uint64_t)1 << running);
+    self.tlb.invalidate(page);
+    sharers[frame] = 0;
+    for (size_t c = 0; c < cores.size(); c++) {   // a core that has finished its trace needs no IPI
+        if ((targets >> c & 1) && cores[c]->done.load(std::memory_order_acquire)) { targets &= ~((uint64_t)1 << c); }
+    }
+    if (targets == 0) { return; }
+    ++self.shootdowns;
+    for (size_t c = 0; c < cores.size(); c++) {
+        if (targets >> c & 1) { cores[c]->post(page);  ++self.ipis_sent; }
+    }
+    for (size_t c = 0; c < cores.size(); c++) {
+        if (!(targets >> c & 1)) { continue; }
+        while (cores[c]->pending.load(std::memory_order_acquire) != 0 && !cores[c]->done.load(std::memory_order_acquire)) {
+            std::this_thread::yield();
+        }
     }
 }
 
-void check_address_value(size_t logic_add, size_t page, size_t offset, size_t physical_add,
-                         size_t& prev_frame, size_t frame, int val, int value, size_t o) { 
-    printf("log: %5lu 0x%04x (pg:%3lu, off:%3lu)-->phy: %5lu (frm: %3lu) (prv: %3lu)--> val: %4d == value: %4d -- %s", 
-          logic_add, (unsigned int)logic_add, page, offset, physical_add, frame, prev_frame, 
-          val, value, passed_or_failed(val == value));
-
+void simulator::context_switch(uint32_t pid) {  // the next reference belongs to pid
+    auto it = asids.find(pid);
+    size_t next = it == asids.end() ? procs.size() : it->second;
+    if (it == asids.end()) {
+        if (asids.empty()) {            // the first process takes the address space set up for it
+            next = 0;
+            procs[0].pid = pid;
+        } else {
+            if (next >= MAX_PROCESSES || options.vpn_bits + 1 >= 64 || (next >> (63 - options.vpn_bits)) != 0) {
+                fprintf(stderr, "Too many processes: at most %d, and as many as fit above %u-bit page numbers\n",
+                        MAX_PROCESSES, options.vpn_bits);
+                exit(ARGC_ERROR);
+            }
+            if (strcmp(options.policy_name, "opt") == 0) {
+                fprintf(stderr, "opt replays a single address space and cannot run a multi-process trace\n");
+                exit(ARGC_ERROR);
+            }
+            if (!options.inverted) { tables.push_back(new_table()); }
+            procs.push_back({ pid, 0, 0, 0 });
+        }
+        asids[pid] = next;
+    }
+    if (next == asid) { return; }
+    asid = next;
+    ++switches;
+    if (options.tlb_flush) {
+        flushed += tlb.flush() + stlb.flush() + tlbpf.buffer.flush();
+        for (unsigned s = 0; s < options.huge_count; s++) { flushed += huge[s].tlb.flush(); }
+    }
+}
+
+struct fifo_policy : replace_policy {   // frames fill in order, so the oldest page always sits at the next slot
+    size_t next_frame_to_replace = 0;
+
+    using replace_policy::replace_policy;
+    size_t choose_victim(size_t) override {
+        size_t frame = next_frame_to_replace;
+        next_frame_to_replace = (next_frame_to_replace + 1) % sim.nframes;
+        return frame;
+    }
+};
+
+struct lru_policy : replace_policy {    // intrusive recency list over frames, most recently used at head
+    std::vector<size_t> prev, next;
+    size_t head = NIL_FRAME, tail = NIL_FRAME;
+
+    lru_policy(simulator& s) : replace_policy(s), prev(s.nframes, NIL_FRAME), next(s.nframes, NIL_FRAME) {}
+
+    void unlink(size_t frame) {
+        if (prev[frame] != NIL_FRAME) { next[prev[frame]] = next[frame]; } else if (head == frame) { head = next[frame]; }
+        if (next[frame] != NIL_FRAME) { prev[next[frame]] = prev[frame]; } else if (tail == frame) { tail = prev[frame]; }
+        prev[frame] = next[frame] = NIL_FRAME;
+    }
+    void touch(size_t frame) {  // O(1): move frame to the most-recently-used end
+        if (head == frame) { return; }
+        unlink(frame);
+        next[frame] = head;
+        if (head != NIL_FRAME) { prev[head] = frame; }
+        head = frame;
+        if (tail == NIL_FRAME) { tail = frame; }
+    }
+
+    void on_access(size_t frame) override { touch(frame); }
+    void on_fault(size_t, size_t frame) override { touch(frame); }
+    size_t choose_victim(size_t) override {
+        size_t frame = tail;
+        unlink(frame);
+        return frame;
+    }
+};
+
+struct clock_policy : replace_policy {  // second chance: the hand clears is_used bits until it finds an unreferenced page
+    size_t hand = 0;
+
+    using replace_policy::replace_policy;
+    size_t choose_victim(size_t) override {
+        // Each step clears one is_used bit, so at most one full revolution is needed.
+        for (;;) {
+            size_t frame = hand;
+            hand = (hand + 1) % sim.nframes;
+            page_node& r = sim.pte(sim.page_of_frame(frame));
+            if (!r.is_used) { return frame; }
+            r.is_used = false;
+        }
+    }
+};
+
+// CLOCK-Pro (Jiang, Chen, Zhang 2005). Resident hot and cold pages and non-resident
+// cold pages still in their test period share one circular list swept by three hands.
+// The reference bit of a resident page is its is_used bit in the page table. hand_cold may
+// release more than one frame per sweep, so it unmaps pages itself and keeps the spares.
+struct clockpro_policy : replace_policy {
+    enum { HOT, COLD, TEST };
+    struct node {
+        size_t npage;
+        size_t frame_num;
+        int type;
+        size_t prev, next;
+    };
+
+    std::vector<node> nodes;                         // at most nframes resident + nframes test pages
+    size_t free_node = 0;
+    std::unordered_map<size_t, size_t> index;        // page -> node
+    size_t hand_hot = NIL_FRAME, hand_cold = NIL_FRAME, hand_test = NIL_FRAME;
+    size_t count_hot = 0, count_cold = 0, count_test = 0;
+    size_t cold_target = sim.nframes;                // adaptive share of memory for cold pages
+    std::vector<size_t> freed;                       // frames released by hand_cold
+    size_t nfreed = 0;
+
+    clockpro_policy(simulator& s) : replace_policy(s), nodes(2 * s.nframes + 1), freed(s.nframes) {
+        for (size_t i = 0; i < nodes.size(); i++) { nodes[i].next = i + 1 < nodes.size() ? i + 1 : NIL_FRAME; }
+    }
+
+    void link(size_t n) {  // insert just behind hand_hot, i.e. at the list head
+        index[nodes[n].npage] = n;
+        if (hand_hot == NIL_FRAME) {
+            nodes[n].prev = nodes[n].next = n;
+            hand_hot = hand_cold = hand_test = n;
+            return;
+        }
+        size_t before = nodes[hand_hot].prev;
+        nodes[n].prev = before;
+        nodes[n].next = hand_hot;
+        nodes[before].next = n;
+        nodes[hand_hot].prev = n;
+        if (hand_cold == hand_hot) { hand_cold = n; }
+    }
+
+    void unlink(size_t n) {
+        index.erase(nodes[n].npage);
+        size_t prev = nodes[n].prev, next = nodes[n].next;
+        if (next == n) {
+            hand_hot = hand_cold = hand_test = NIL_FRAME;
+            return;
+        }
+        if (hand_hot == n) { hand_hot = prev; }
+        if (hand_cold == n) { hand_cold = prev; }
+        if (hand_test == n) { hand_test = prev; }
+        nodes[prev].next = next;
+        nodes[next].prev = prev;
+    }
+
+    void run_hand_test() {  // end the test period of the oldest non-resident page
+        if (hand_test == hand_cold) { run_hand_cold(); }
+        size_t n = hand_test;
+        if (nodes[n].type == TEST) {
+            unlink(n);
+            nodes[n].next = free_node;
+            free_node = n;
+            --count_test;
+            if (cold_target > 1) { --cold_target; }
+        }
+        if (hand_test != NIL_FRAME) { hand_test = nodes[hand_test].next; }
+    }
+
+    void run_hand_hot() {  // demote hot pages that were not referenced since the last sweep
+        if (hand_hot == hand_test) { run_hand_test(); }
+        node& n = nodes[hand_hot];
+        if (n.type == HOT) {
+            page_node& r = sim.pte(n.npage);
+            if (r.is_used) {
+                r.is_used = false;
+            } else {
+                n.type = COLD;
+                --count_hot;
+                ++count_cold;
+            }
+        }
+        hand_hot = nodes[hand_hot].next;
+    }
+
+    void run_hand_cold() {  // promote referenced cold pages, evict unreferenced ones into test
+        node& n = nodes[hand_cold];
+        if (n.type == COLD) {
+            page_node& r = sim.pte(n.npage);
+            if (r.is_used) {
+                r.is_used = false;
+                n.type = HOT;
+                --count_cold;
+                ++count_hot;
+            } else {
+                sim.unmap_frame(n.frame_num);
+                freed[nfreed++] = n.frame_num;
+                n.type = TEST;
+                n.frame_num = NIL_FRAME;
+                --count_cold;
+                ++count_test;
+                while (count_test > sim.nframes) { run_hand_test(); }
+            }
+        }
+        hand_cold = nodes[hand_cold].next;
+        while (sim.nframes - cold_target < count_hot) { run_hand_hot(); }
+    }
+
+    size_t choose_victim(size_t) override {
+        while (nfreed == 0) { run_hand_cold(); }
+        return freed[--nfreed];
+    }
+
+    void on_fault(size_t page, size_t frame) override {
+        sim.pte(page).is_used = false;
+        auto it = index.find(page);
+        if (it != index.end()) {     // faulted during its test period: reuse distance is short, make it hot
+            size_t n = it->second;
+            unlink(n);
+            if (cold_target < sim.nframes) { ++cold_target; }
+            --count_test;
+            ++count_hot;
+            nodes[n].type = HOT;
+            nodes[n].frame_num = frame;
+            link(n);
+            return;
+        }
+        size_t n = free_node;
+        free_node = nodes[n].next;
+        nodes[n] = {page, frame, COLD, NIL_FRAME, NIL_FRAME};
+        ++count_cold;
+        link(n);
+    }
+};
+
+// ARC (Megiddo, Modha 2003). T1 holds pages seen once, T2 pages seen at least twice;
+// B1/B2 remember pages evicted from each. Ghost hits move the T1 target size p.
+struct arc_policy : replace_policy {
+    page_list t1, t2, b1, b2;
+    size_t p = 0;
+    bool adapted = false;   // choose_victim already adapted p for the incoming page
+
+    using replace_policy::replace_policy;
+
+    void adapt(size_t page) {
+        if (b1.contains(page)) {
+            p = std::min(sim.nframes, p + std::max(b2.size() / b1.size(), (size_t)1));
+        } else if (b2.contains(page)) {
+            p -= std::min(p, std::max(b1.size() / b2.size(), (size_t)1));
+        }
+        adapted = true;
+    }
+
+    size_t replace(bool in_b2) {
+        size_t page;
+        if (t1.size() > 0 && (t1.size() > p || (in_b2 && t1.size() == p))) {
+            page = t1.pop_back();
+            b1.push_front(page);
+        } else {
+            page = t2.pop_back();
+            b2.push_front(page);
+        }
+        return sim.frame_of_page(page);
+    }
+
+    void on_access(size_t frame) override {
+        size_t page = sim.page_of_frame(frame);
+        if (t1.contains(page)) { t1.remove(page); }
+        t2.touch(page);
+    }
+
+    size_t choose_victim(size_t page) override {
+        adapt(page);
+        if (b1.contains(page) || b2.contains(page)) { return replace(b2.contains(page)); }
+        if (t1.size() + b1.size() >= sim.nframes) {
+            if (t1.size() < sim.nframes) {
+                b1.pop_back();
+                return replace(false);
+            }
+            return sim.frame_of_page(t1.pop_back());  // T1 alone fills memory: drop its LRU page without a ghost
+        }
+        if (t1.size() + t2.size() + b1.size() + b2.size() >= 2 * sim.nframes) { b2.pop_back(); }
+        return replace(false);
+    }
+
+    void on_fault(size_t page, size_t) override {
+        if (!adapted) { adapt(page); }
+        adapted = false;
+        if (b1.contains(page) || b2.contains(page)) {
+            b1.remove(page);
+            b2.remove(page);
+            t2.push_front(page);
+        } else {
+            t1.push_front(page);
+        }
+    }
+};
+
+// 2Q (Johnson, Shasha 1994). New pages enter the A1in FIFO; only pages re-referenced
+// after falling out of it (still remembered in A1out) are promoted to the Am LRU list.
+struct twoq_policy : replace_policy {
+    page_list a1in, a1out, am;
+    size_t kin = std::max(sim.nframes / 4, (size_t)1), kout = std::max(sim.nframes / 2, (size_t)1);
+
+    using replace_policy::replace_policy;
+
+    void on_access(size_t frame) override {
+        size_t page = sim.page_of_frame(frame);
+        if (am.contains(page)) { am.touch(page); }   // A1in hits are correlated references: leave them
+    }
+
+    size_t choose_victim(size_t) override {
+        if (a1in.size() > kin || am.size() == 0) {
+            size_t page = a1in.pop_back();
+            a1out.push_front(page);
+            if (a1out.size() > kout) { a1out.pop_back(); }
+            return sim.frame_of_page(page);
+        }
+        return sim.frame_of_page(am.pop_back());
+    }
+
+    void on_fault(size_t page, size_t) override {
+        if (a1out.contains(page)) {
+            a1out.remove(page);
+            am.push_front(page);
+        } else {
+            a1in.push_front(page);
+        }
+    }
+};
+
+// LFU with dynamic aging (LFU-DA). A page's priority is its reference count plus the
+// priority of the last victim at the time it was loaded, so stale heavy hitters age out.
+struct lfu_policy : replace_policy {
+    std::vector<size_t> priority, stamp;
+    size_t age = 0, tick = 0;
+    std::set<std::pair<std::pair<size_t, size_t>, size_t>> queue;   // ((priority, stamp), frame), lowest first
+
+    lfu_policy(simulator& s) : replace_policy(s), priority(s.nframes), stamp(s.nframes) {}
+
+    void requeue(size_t frame, size_t new_priority) {
+        queue.erase({{priority[frame], stamp[frame]}, frame});
+        priority[frame] = new_priority;
+        stamp[frame] = ++tick;          // ties go to the least recently used page
+        queue.insert({{priority[frame], stamp[frame]}, frame});
+    }
+
+    void on_access(size_t frame) override { requeue(frame, priority[frame] + 1); }
+    void on_fault(size_t, size_t frame) override {
+        priority[frame] = stamp[frame] = 0;
+        requeue(frame, age + 1);
+    }
+    size_t choose_victim(size_t) override {
+        auto it = queue.begin();
+        size_t frame = it->second;
+        age = it->first.first;
+        queue.erase(it);
+        return frame;
+    }
+};
+
+// LIRS (Jiang, Zhang 2002). Stack S orders pages by recency; LIR pages (short reuse
+// distance) keep their frames while resident HIR pages wait in queue Q for eviction.
+// Non-resident HIR pages stay in S to recognise a short reuse distance on their next
+// fault; at most sim.nframes of them are remembered.
+struct lirs_policy : replace_policy {
+    enum { LIR, HIR, NONRESIDENT };
+    page_list s, q, ghosts;
+    std::unordered_map<size_t, int> status;
+    size_t lir_target = sim.nframes - std::max(sim.nframes / 100, (size_t)1);
+    size_t lir_count = 0;
+
+    using replace_policy::replace_policy;
+
+    void prune() {   // the bottom of S must be a LIR page
+        while (s.size() > 0 && status[s.back()] != LIR) {
+            size_t page = s.pop_back();
+            if (status[page] == NONRESIDENT) {
+                ghosts.remove(page);
+                status.erase(page);
+            }
+        }
+    }
+
+    void demote_bottom_lir() {
+        prune();
+        if (s.size() == 0) { return; }
+        size_t page = s.pop_back();
+        status[page] = HIR;
+        q.push_front(page);
+        --lir_count;
+        prune();
+    }
+
+    void promote(size_t page) {   // HIR page with a reuse distance inside the LIR set
+        s.touch(page);
+        q.remove(page);
+        ghosts.remove(page);
+        status[page] = LIR;
+        ++lir_count;
+        demote_bottom_lir();
+    }
+
+    void on_access(size_t frame) override {
+        size_t page = sim.page_of_frame(frame);
+        if (status[page] == LIR) {
+            bool was_bottom = s.back() == page;
+            s.touch(page);
+            if (was_bottom) { prune(); }
+        } else if (s.contains(page)) {
+            promote(page);
+        } else {
+            s.push_front(page);
+            q.touch(page);
+        }
+    }
+
+    size_t choose_victim(size_t) override {
+        if (q.size() == 0) { demote_bottom_lir(); }
+        size_t page = q.pop_back();
+        if (s.contains(page)) {
+            status[page] = NONRESIDENT;
+            ghosts.push_front(page);
+            if (ghosts.size() > sim.nframes) {
+                size_t old = ghosts.pop_back();
+                s.remove(old);
+                status.erase(old);
+            }
+        } else {
+            status.erase(page);
+        }
+        return sim.frame_of_page(page);
+    }
+
+    void on_fault(size_t page, size_t) override {
+        if (lir_count < lir_target) {   // warm-up: the first pages form the LIR set
+            ghosts.remove(page);
+            s.touch(page);
+            status[page] = LIR;
+            ++lir_count;
+        } else if (s.contains(page)) {
+            promote(page);
+        } else {
+            status[page] = HIR;
+            s.push_front(page);
+            q.push_front(page);
+        }
+    }
+};
+
+std::vector<size_t> load_addresses(const char* path, std::vector<uint32_t>* pids = nullptr,
+                                   std::vector<unsigned char>* all_ops = nullptr) {  // a whole trace in memory
+    std::vector<size_t> addresses, batch;
+    std::vector<unsigned char> ops;
+    trace_source* trace = open_trace(path);
+    while (trace->next_batch(batch, ops)) {
+        if (pids != nullptr && !trace->pids.empty()) {
+            pids->resize(addresses.size(), 0);
+            pids->insert(pids->end(), trace->pids.begin(), trace->pids.end());
+        }
+        if (all_ops != nullptr && (!all_ops->empty() || std::count(ops.begin(), ops.end(), OP_WRITE) != 0)) {   // from the first write on
+            all_ops->resize(addresses.size(), OP_READ);
+            all_ops->insert(all_ops->end(), ops.begin(), ops.end());
+            all_ops->resize(addresses.size() + batch.size(), OP_READ);
+        }
+        addresses.insert(addresses.end(), batch.begin(), batch.end());
+    }
+    delete trace;
+    return addresses;
+}
+
+std::vector<int> load_values(const char* path) {
+    std::vector<int> values;
+    value_stream in(path);
+    int v;
+    while (in.next(v)) { values.push_back(v); }
+    return values;
+}
+
+// Round-robin scheduling for a multi-process trace: each process's references keep their
+// order, and processes take turns, in order of first appearance, running `quantum` of them
+// at a time. The expected values and read/write ops move with their references.
+void schedule_processes(std::vector<size_t>& addresses, std::vector<uint32_t>& pids, std::vector<int>& values,
+                        std::vector<unsigned char>& ops, size_t quantum) {
+    if (pids.empty()) { return; }
+    std::vector<uint32_t> order;
+    std::unordered_map<uint32_t, std::deque<size_t>> queues;
+    for (size_t i = 0; i < addresses.size(); i++) {
+        if (queues.count(pids[i]) == 0) { order.push_back(pids[i]); }
+        queues[pids[i]].push_back(i);
+    }
+    if (!values.empty() && values.size() < addresses.size()) {
+        fprintf(stderr, "Warning: fewer expected values than references, not checking values of a rescheduled trace\n");
+        values.clear();
+    }
+    std::vector<size_t> a, idx;
+    std::vector<uint32_t> p;
+    a.reserve(addresses.size());
+    p.reserve(addresses.size());
+    for (size_t left = addresses.size(); left > 0; ) {
+        for (uint32_t pid : order) {
+            std::deque<size_t>& q = queues[pid];
+            for (size_t k = 0; k < quantum && !q.empty(); k++, left--) {
+                idx.push_back(q.front());
+                a.push_back(addresses[q.front()]);
+                p.push_back(pid);
+                q.pop_front();
+            }
+        }
+    }
+    if (!values.empty()) {
+        std::vector<int> v(idx.size());
+        for (size_t k = 0; k < idx.size(); k++) { v[k] = values[idx[k]]; }
+        values.swap(v);
+    }
+    if (!ops.empty()) {
+        std::vector<unsigned char> w(idx.size());
+        for (size_t k = 0; k < idx.size(); k++) { w[k] = ops[idx[k]]; }
+        ops.swap(w);
+    }
+    addresses.swap(a);
+    pids.swap(p);
+}
+
+std::vector<size_t> load_page_trace(const char* path) {  // page of every reference in a trace
+    std::vector<size_t> pages, batch;
+    std::vector<unsigned char> ops;
+    trace_source* trace = open_trace(path);
+    while (trace->next_batch(batch, ops)) {
+        for (size_t x : batch) { pages.push_back(get_page(x)); }
+    }
+    delete trace;
+    return pages;
+}
+
+// Belady's OPT (MIN): an offline oracle that evicts the page whose next use lies
+// farthest in the future. The whole trace is read up front and next_use[i] holds the
+// index of the next reference to the same page as reference i. Resident frames sit in a
+// max-heap keyed by next use; entries made stale by later references are skipped lazily.
+struct opt_policy : replace_policy {
+    std::vector<size_t> next_use;
+    std::unordered_map<size_t, size_t> upcoming;      // page -> its next reference at or after pos
+    size_t pos = 0;                                   // index of the reference being simulated
+    std::vector<size_t> frame_next;
+    std::priority_queue<std::pair<size_t, size_t>> heap;   // (next use, frame)
+
+    opt_policy(simulator& s) : replace_policy(s), frame_next(s.nframes) {
+        std::vector<size_t> pages;
+        if (s.preloaded != nullptr) {
+            pages.reserve(s.preloaded->size());
+            for (size_t x : *s.preloaded) { pages.push_back(get_page(x)); }
+        } else {
+            pages = load_page_trace(s.options.address_file);
+        }
+        std::unordered_map<size_t, size_t> seen;
+        next_use.resize(pages.size());
+        for (size_t i = pages.size(); i-- > 0; ) {
+            auto it = seen.find(pages[i]);
+            next_use[i] = it == seen.end() ? SIZE_MAX : it->second;
+            seen[pages[i]] = i;
+        }
+        upcoming.swap(seen);
+    }
+
+    void schedule(size_t frame, size_t next) {
+        frame_next[frame] = next;
+        heap.push({next, frame});
+        if (heap.size() > 4 * sim.nframes) { compact(); }
+    }
+
+    void referenced(size_t frame) {
+        size_t next = pos < next_use.size() ? next_use[pos] : SIZE_MAX;
+        upcoming[sim.page_of_frame(frame)] = next;
+        ++pos;
+        schedule(frame, next);
+    }
+
+    void compact() {  // drop stale entries so the heap stays O(frames)
+        std::priority_queue<std::pair<size_t, size_t>> live;
+        for (size_t f = 0; f < sim.nframes; f++) {
+            if (sim.frame_table[f].is_mapped) { live.push({frame_next[f], f}); }
+        }
+        heap.swap(live);
+    }
+
+    void on_access(size_t frame) override { referenced(frame); }
+    void on_fault(size_t, size_t frame) override { referenced(frame); }
+    void on_prefetch(size_t page, size_t frame) override {
+        auto it = upcoming.find(page);
+        schedule(frame, it == upcoming.end() ? SIZE_MAX : it->second);
+    }
+    size_t choose_victim(size_t) override {
+        for (;;) {
+            std::pair<size_t, size_t> top = heap.top();
+            heap.pop();
+            if (sim.frame_table[top.second].is_mapped && frame_next[top.second] == top.first) { return top.second; }
+        }
+    }
+};
+
+struct policy_entry {
+    const char* name;
+    replace_policy* (*make)(simulator&);
+};
+
+const policy_entry policies[] = {
+    { "fifo",     [](simulator& s) -> replace_policy* { return new fifo_policy(s); } },
+    { "lru",      [](simulator& s) -> replace_policy* { return new lru_policy(s); } },
+    { "clock",    [](simulator& s) -> replace_policy* { return new clock_policy(s); } },
+    { "clockpro", [](simulator& s) -> replace_policy* { return new clockpro_policy(s); } },
+    { "arc",      [](simulator& s) -> replace_policy* { return new arc_policy(s); } },
+    { "2q",       [](simulator& s) -> replace_policy* { return new twoq_policy(s); } },
+    { "lfu",      [](simulator& s) -> replace_policy* { return new lfu_policy(s); } },
+    { "lirs",     [](simulator& s) -> replace_policy* { return new lirs_policy(s); } },
+    { "opt",      [](simulator& s) -> replace_policy* { return new opt_policy(s); } },
+};
+
+const policy_entry* find_policy(const char* name) {  // nullptr for an unknown name
+    for (const policy_entry& p : policies) {
+        if (strcmp(p.name, name) == 0) { return &p; }
+    }
+    return nullptr;
+}
+
+replace_policy* make_policy(const char* name, simulator& sim) { return find_policy(name)->make(sim); }
+
+const char* simulator::read_pages(size_t first, size_t count, char* buf) {  // count pages starting at first
+    // One request for the whole run of pages, whether it is a read or faults in a mapped range
+    size_t pos = vpn(first) * options.page_size, len = count * options.page_size;
+    ++stats.pagein_reads;
+    if (options.pagein != PAGEIN_READ && pos + len <= backing_size) { return backing_map + pos; }
+
+    memset(buf, 0, len);      // anything past the end of the store reads as zeros
+#if defined(HAVE_MMAP)
+    pread(fileno(fbacking), buf, len, (off_t)pos);
+#else
+    fseek(fbacking, pos, SEEK_SET);
+    fread(buf, 1, len, fbacking);
+#endif
+    return buf;
+}
+
+void simulator::fill_frame(size_t frame, const char* src) {  // src holds one page read from the backing store
+    char* slot = ram.data() + (frame * options.page_size);
+    if (options.pagein == PAGEIN_REMAP && src >= backing_map && src < backing_map + backing_size) {
+        frame_data[frame] = src;
+        return;
+    }
+    memcpy(slot, src, options.page_size);
+    frame_data[frame] = slot;
+}
+
+void simulator::page_in(size_t page, size_t frame) {
+    if (wb_queue.count(vpn(page))) { return; }   // no read: update_frame_ptable takes it from the write-back queue
+    fill_frame(frame, read_pages(page, 1, page_buf.data()));
+}
+
+void simulator::fault_around(size_t page, size_t frame) {
+    // Read the aligned cluster around page in one request, place the demand page, then
+    // map every other page of the cluster that is not resident into the free frames left.
+    size_t first = page - vpn(page) % options.cluster;
+    const char* data = read_pages(first, options.cluster, cluster_buf.data());
+
+    fill_frame(frame, data + (page - first) * options.page_size);
+    for (size_t p = first; p < first + options.cluster && frames_used < nframes; p++) {
+        if (p == page || asid_of(p) != asid_of(page) || is_resident(p)) { continue; }
+        size_t f = frames_used++;
+        fill_frame(f, data + (p - first) * options.page_size);
+        update_frame_ptable(p, f);
+        pte(p).is_used = false;
+        frame_table[f].speculative = SPEC_AROUND;
+        policy->on_prefetch(p, f);
+        ++stats.prefetched;
+    }
+}
+
+void simulator::page_fault(size_t& frame, size_t& page) {  
+    bool is_memfull = frames_used >= nframes;
+
+    ++pg_faults;
+
+    if (is_memfull) {
+        // Memory is full, we need to replace a page
+        frame = policy->choose_victim(page);
+        unmap_frame(frame);
+    } else {
+        // Memory is not full, use the next available frame
+        frame = frames_used++;
+    }
+
+    if (options.cluster > 1 && frames_used < nframes) {
+        fault_around(page, frame);
+    } else {
+        page_in(page, frame);
+    }
+
+    // Update the page table with the new frame
+    update_frame_ptable(page, frame);
+    policy->on_fault(page, frame);
+
+    // Add the page to the TLB
+    tlb_fill({page, frame, true, false, false});
+}
+
+bool stride_prefetcher::prefetch_page(size_t p) {
+    if (sim.is_resident(p)) { return false; }
+    size_t f;
+    if (sim.frames_used < sim.nframes) {
+        f = sim.frames_used++;
+    } else {
+        f = sim.policy->choose_victim(p);
+        victims.touch(sim.frame_table[f].npage);
+        if (victims.size() > sim.nframes) { victims.pop_back(); }
+        ++sim.stats.pf_evictions;
+        sim.unmap_frame(f);
+    }
+    sim.page_in(p, f);
+    sim.update_frame_ptable(p, f);
+    sim.pte(p).is_used = false;
+    sim.frame_table[f].speculative = SPEC_STRIDE;
+    sim.policy->on_prefetch(p, f);
+    ++sim.stats.pf_issued;
+    return true;
+}
+
+void stride_prefetcher::on_fault(size_t page) {
+    if (victims.contains(page)) {   // demanded again after a prefetch pushed it out
+        victims.remove(page);
+        ++sim.stats.pf_pollution;
+    }
+    pf_stream* s = train(page);
+    if (s == nullptr || s->confidence < 1) { return; }
+    long long next = (long long)s->frontier;
+    for (size_t k = 0; k < degree; k++) {
+        next += s->stride;
+        if (next < 0 || sim.asid_of((size_t)next) != sim.asid_of(page)) { break; }
+        prefetch_page((size_t)next);
+        s->frontier = (size_t)next;
+    }
+}
+
+bool tlb_prefetcher::issue(size_t page, long long distance) {  // install the translation of page + distance if it is resident
+    long long target = (long long)page + distance;
+    if (distance == 0 || target < 0 || sim.asid_of((size_t)target) != sim.asid_of(page)) { return false; }
+    size_t p = (size_t)target;
+    if (sim.tlb.lookup(p) >= 0 || (buffer.size && buffer.lookup(p) >= 0) || (sim.stlb.size && sim.stlb.lookup(p) >= 0)) {
+        return false;         // already translated; a second copy in an exclusive STLB would outlive eviction
+    }
+    for (unsigned s = 0; s < sim.options.huge_count; s++) {
+        if (sim.huge[s].tlb.lookup(p >> sim.huge[s].shift) >= 0) { return false; }
+    }
+    ++sim.stats.tlbpf_walks;
+    page_node* e = sim.space(p).find(sim.vpn(p), sim.stats.tlbpf_steps);
+    if (e == nullptr || !e->is_present) { return false; }
+    page_node entry = { p, e->frame_num, true, false, e->is_dirty };
+    if (buffer.size) {
+        buffer.insert(entry);
+    } else {
+        sim.tlb_fill(entry);
+        pending.insert(p);
+    }
+    ++sim.stats.tlbpf_filled;
+    return true;
+}
+
+bool tlb_prefetcher::buffer_hit(size_t& frame, size_t page) {  // L1 missed: a prefetch may have brought the translation
+    int index = buffer.lookup(page);
+    if (index < 0) { return false; }
+    page_node e = buffer.entries[index];
+    buffer.remove(index);      // promoted into the TLB on first use
+    ++buffer.hits;
+    ++sim.tlb_hits;
+    ++sim.stats.tlbpf_useful;
+    frame = e.frame_num;
+    sim.pte(page).is_used = true;
+    sim.policy->on_access(frame);
+    if (sim.frame_table[frame].speculative != SPEC_NONE) { sim.resolve_speculation(frame, true); }
+    sim.tlb_fill(e);
+    train(page);
+    return true;
+}
+
+void tlb_prefetcher::used(size_t page, size_t frame) {  // a TLB hit: on a prefetched translation, the first one saved a walk
+    if (pending.erase(page) == 0) { return; }
+    ++sim.stats.tlbpf_useful;
+    if (sim.frame_table[frame].speculative != SPEC_NONE) { sim.resolve_speculation(frame, true); }
+    train(page);
+}
+
+void tlb_prefetcher::on_miss(size_t page) {
+    pending.erase(page);       // demand filled now, whatever became of an earlier prefetch
+    train(page);
+}
+
+void tlb_prefetcher::train(size_t page) {  // a miss, or one saved by a prefetch: learn from it and prefetch on
+    bool same = started && sim.asid_of(last) == sim.asid_of(page);
+    long long distance = same ? (long long)page - (long long)last : 0;
+    switch (sim.options.tlb_prefetch) {
+    case TLBPF_SEQUENTIAL:
+        issue(page, 1);
+        break;
+    case TLBPF_STRIDE:
+        if (distance == last_distance) { issue(page, distance); }
+        break;
+    case TLBPF_DISTANCE:
+        if (distance == 0) { break; }
+        if (last_distance != 0) { learn(last_distance, distance); }
+        if (row(distance).valid && row(distance).distance == distance) {
+            for (long long next : row(distance).next) { issue(page, next); }
+        }
+        break;
+    }
+    last = page;
+    last_distance = distance;
+    started = true;
+}
+
+void simulator::check_address_value(size_t logic_add, size_t page, size_t offset, size_t physical_add,
+                                   size_t& prev_frame, size_t frame, int val, int value, size_t o) { 
+    if (val != value) { ++failed_asserts; }
+    if (failed_asserts > 5 && exit_on_failure) { exit(-1); }
+    if (options.quiet) { return; }
+
+    printf("log: %5zu 0x%04zx (pg:%3zu, off:%3zu)-->phy: %5zu (frm: %3zu) (prv: %3zu)--> val: %4d == value: %4d -- %s", 
+          logic_add, logic_add, page, offset, physical_add, frame, prev_frame, 
+          val, value, passed_or_failed(val == value));
+
     if (frame < prev_frame) {  printf("   HIT!\n");
     } else {
         prev_frame = frame;
@@ -287,56 +2553,1212 @@ void check_address_value(size_t logic_add, size_t page, size_t offset, size_t ph
     }
     if (o % 5 == 4) { printf("\n"); }
 // if (o > 20) { exit(-1); }             // to check out first 20 elements
-
-    if (val != value) { ++failed_asserts; }
-    if (failed_asserts > 5) { exit(-1); }
 //     assert(val == value);
 }
 
-void run_simulation() { 
-        // addresses, pages, frames, values, hits and faults
-    size_t logic_add, virt_add, phys_add, physical_add;
-    size_t page, frame, offset, value, prev_frame = 0, tlb_track = 0;
-    size_t frames_used = 0, pg_faults = 0, tlb_hits = 0;
-    int val = 0;
-    char buf[BUFSIZ];
-
-    bool is_memfull = false;     // physical memory to store the frames
-
+simulator::simulator(const sim_options& opts, const std::vector<size_t>* trace)
+    : options(opts), nframes(opts.nframes), ram(nframes * opts.page_size), frame_data(nframes), frame_table(nframes),
+      prefetcher(*this), tlbpf(*this),
+      page_buf(opts.page_size), cluster_buf(MAX_CLUSTER * opts.page_size), preloaded(trace) {
     initialize_pg_table_tlb();
+    policy = make_policy(options.policy_name, *this);
+    open_files(fbacking, options.write_back);
+}
 
-        // addresses to test, correct values, and pages to load
-    FILE *faddress, *fcorrect, *fbacking;
-    open_files(faddress, fcorrect, fbacking);
-
-    for (int o = 0; o < 1000; o++) {     // read from file correct.txt
-        fscanf(fcorrect, "%s %s %lu %s %s %lu %s %ld", buf, buf, &virt_add, buf, buf, &phys_add, buf, &value);  
+simulator::~simulator() {
+    delete policy;
+    for (page_table* t : tables) { delete t; }
+    close_files(fbacking);  // and time to wrap things up
+}
 
-        fscanf(faddress, "%ld", &logic_add);  
+void simulator::run(trace_source* trace, value_source* expected) { 
+        // addresses, pages, frames and values
+    size_t logic_add, physical_add;
+    size_t page, frame, offset, prev_frame = 0;
+    int val = 0, value;
+
+        // addresses to test, in batches, and correct values; the backing store holds the pages to load
+    std::vector<size_t> batch;
+    std::vector<unsigned char> ops;
+    size_t window_faults = 0, window_hits = 0;
+
+    size_t o = 0;
+    for (size_t i = 0; ; o++, i++) {     // every reference in the trace, checked against correct.txt
+        if (i == batch.size()) {
+            if (!trace->next_batch(batch, ops)) { break; }
+            i = 0;
+        }
+        logic_add = batch[i];
         get_page_offset(logic_add, page, offset);
+        size_t walks = stats.walks;
+        if (!trace->pids.empty()) {
+            if (trace->pids[i] != procs[asid].pid || asids.empty()) { context_switch(trace->pids[i]); }
+            page |= asid << options.vpn_bits;
+        }
 
-        int result = check_tlb(page);
+        int result = tlb.lookup(page);
+        bool faulted = false;
         if (result >= 0) {  
-            tlb_hit(frame, page, tlb_hits, result); 
-        } else if (pg_table[page].is_present) {
-            tlb_miss(frame, page, tlb_track);
+            tlb_hit(frame, page, result); 
+        } else if (options.huge_count && huge_hit(frame, page)) {
+        } else if (tlbpf.buffer.size && tlbpf.buffer_hit(frame, page)) {
+        } else if (stlb.size && stlb_hit(frame, page)) {
+        } else if (page_walk(page)) {
+            tlb_miss(frame, page);
         } else {         // page fault
-            page_fault(frame, page, frames_used, pg_faults, tlb_track, fbacking);
+            page_fault(frame, page);
+            faulted = true;
         }
 
-        physical_add = (frame * FRAME_SIZE) + offset;
-        val = (int)*(ram + physical_add);
+        physical_add = (frame * options.page_size) + offset;
+        val = (int)frame_data[frame][offset];
+        if (expected == nullptr || !expected->next(value)) { value = val; }   // nothing to check against once expected values run out
 
         check_address_value(logic_add, page, offset, physical_add, prev_frame, frame, val, value, o);
+
+        if (!ops.empty() && ops[i] == OP_WRITE) { mark_dirty(page); }
+        if (options.huge_count) { huge_reference(page); }
+        if (options.tlb_prefetch != TLBPF_NONE && stats.walks != walks) { tlbpf.on_miss(page); }
+        if (!trace->pids.empty()) {
+            process_info& p = procs[asid];
+            ++p.refs;
+            p.faults += faulted;
+            p.walks += stats.walks - walks;
+        }
+
+        // prefetch only once this reference has read its value, so it can't evict the page under it
+        if (faulted && options.prefetch) { prefetcher.on_fault(page); }
+
+        if (options.window && (o + 1) % options.window == 0) {   // rolling rates over the last window
+            printf("window %zu-%zu: faults %1.3f%% tlb hits %1.3f%%\n", o + 1 - options.window, o,
+                   percent(pg_faults - window_faults, options.window), percent(tlb_hits - window_hits, options.window));
+            fflush(stdout);
+            window_faults = pg_faults;
+            window_hits = tlb_hits;
+        }
+    }
+    nrefs = o;
+    flush_writeback();
+}
+
+void run_simulation() {
+    simulator* sim = new simulator(options);
+    if (options.quantum) {     // the trace is rescheduled, so it is read into memory first
+        std::vector<uint32_t> pids;
+        std::vector<unsigned char> ops;
+        std::vector<size_t> addresses = load_addresses(options.address_file, &pids, &ops);
+        std::vector<int> values;
+        if (options.verify) { values = load_values(options.correct_file); }
+        schedule_processes(addresses, pids, values, ops, options.quantum);
+        memory_trace trace(addresses, &pids, &ops);
+        value_list expected(values);
+        sim->run(&trace, options.verify ? &expected : nullptr);
+        sim->summarize();
+        delete sim;
+        return;
+    }
+    trace_source* trace = open_trace(options.address_file);
+    value_stream* expected = options.verify ? new value_stream(options.correct_file) : nullptr;
+    sim->run(trace, expected);
+    sim->summarize();
+    delete sim;
+    delete expected;
+    delete trace;
+}
+
+// Runs tasks 0 .. n-1 on a fixed set of threads. Each worker owns a deque, seeded
+// round-robin, and takes work from its back; a worker whose deque is empty steals from
+// the front of the others', so a few slow tasks (opt, large memories) don't leave the
+// remaining cores idle. No task adds work, so once every deque is seen empty we are done.
+struct work_stealing_pool {
+    struct worker_queue {
+        std::mutex lock;
+        std::deque<size_t> tasks;
+    };
+    std::vector<worker_queue> queues;
+    std::vector<size_t> stolen;   // per worker
+
+    bool take(size_t self, size_t& task) {
+        {
+            std::lock_guard<std::mutex> guard(queues[self].lock);
+            if (!queues[self].tasks.empty()) {
+                task = queues[self].tasks.back();
+                queues[self].tasks.pop_back();
+                return true;
+            }
+        }
+        for (size_t k = 1; k < queues.size(); k++) {
+            worker_queue& victim = queues[(self + k) % queues.size()];
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if (!victim.tasks.empty()) {
+                task = victim.tasks.front();
+                victim.tasks.pop_front();
+                ++stolen[self];
+                return true;
+            }
+        }
+        return false;
+    }
+
+    size_t run(size_t ntasks, size_t nthreads, const std::function<void(size_t)>& work) {  // returns tasks stolen
+        queues = std::vector<worker_queue>(nthreads);
+        stolen.assign(nthreads, 0);
+        for (size_t t = 0; t < ntasks; t++) { queues[t % nthreads].tasks.push_back(t); }
+        std::vector<std::thread> threads;
+        for (size_t w = 0; w < nthreads; w++) {
+            threads.emplace_back([this, w, &work]() {
+                size_t task;
+                while (take(w, task)) { work(task); }
+            });
+        }
+        for (std::thread& t : threads) { t.join(); }
+        size_t total = 0;
+        for (size_t n : stolen) { total += n; }
+        return total;
+    }
+};
+
+struct sweep_config {
+    const char* policy_name;
+    size_t nframes, tlb_size;
+    int tlb_repl;
+    size_t faults, hits, failed;   // results
+};
+
+// Every (policy, frames, TLB size, TLB replacement) combination over one trace. The trace
+// and expected values are loaded once and shared read-only; each configuration gets its
+// own simulator.
+void run_sweep(const std::vector<const char*>& policy_names, const std::vector<size_t>& frame_counts,
+               const std::vector<size_t>& tlb_sizes, const std::vector<int>& tlb_repls) {
+    std::vector<uint32_t> pids;
+    std::vector<unsigned char> ops;
+    std::vector<size_t> trace = load_addresses(options.address_file, &pids, &ops);
+    std::vector<int> values;
+    if (options.verify) { values = load_values(options.correct_file); }
+    if (options.quantum) { schedule_processes(trace, pids, values, ops, options.quantum); }
+
+    std::vector<sweep_config> grid;
+    for (const char* name : policy_names) {
+        for (size_t f : frame_counts) {
+            for (size_t t : tlb_sizes) {
+                for (int r : tlb_repls) { grid.push_back({ name, f, t, r, 0, 0, 0 }); }
+            }
+        }
+    }
+    size_t nthreads = options.jobs ? options.jobs : std::max(std::thread::hardware_concurrency(), 1u);
+    nthreads = std::min(nthreads, grid.size());
+
+    work_stealing_pool pool;
+    size_t stolen = pool.run(grid.size(), nthreads, [&](size_t task) {
+        sweep_config& c = grid[task];
+        sim_options o = options;
+        o.policy_name = c.policy_name;
+        o.nframes = c.nframes;
+        o.tlb_size = c.tlb_size;
+        o.tlb_repl = c.tlb_repl;
+        o.quiet = true;
+        o.window = 0;
+        simulator* sim = new simulator(o, &trace);
+        sim->exit_on_failure = false;
+        memory_trace in(trace, &pids, &ops);
+        value_list expected(values);
+        sim->run(&in, options.verify ? &expected : nullptr);
+        c.faults = sim->pg_faults;
+        c.hits = sim->tlb_hits;
+        c.failed = sim->failed_asserts;
+        delete sim;
+    });
+
+    printf("Sweep: %zu configurations, %zu references, %zu threads (%zu configurations stolen)\n\n",
+           grid.size(), trace.size(), nthreads, stolen);
+    bool by_repl = tlb_repls.size() > 1;   // a column for the TLB replacement policy only when it varies
+    printf("%-10s %7s %5s", "policy", "frames", "tlb");
+    if (by_repl) { printf(" %-6s", "repl"); }
+    printf(" %12s %9s %12s %9s  %s\n", "faults", "fault%", "tlb hits", "hit%", "values");
+    for (const sweep_config& c : grid) {
+        printf("%-10s %7zu %5zu", c.policy_name, c.nframes, c.tlb_size);
+        if (by_repl) { printf(" %-6s", tlb_repl_names[c.tlb_repl]); }
+        printf(" %12zu %8.3f%% %12zu %8.3f%%  %s\n", c.faults, percent(c.faults, trace.size()), c.hits, percent(c.hits, trace.size()),
+               !options.verify ? "-" : c.failed ? "FAILED" : "passed");
+    }
+    printf("\n\t\t...done.\n");
+}
+
+// --cores: one host thread per simulated core. A TLB hit touches only the core's own
+// state; hits reach the replacement policy in batches, the way an OS harvests accessed
+// bits. A miss takes the memory lock, handling IPIs while it waits, then walks the shared
+// page table and faults like a single-core run, shooting down other cores' translations
+// of whatever it evicts. A write through a clean TLB entry also takes the lock, to set
+// the PTE's dirty bit. Cores interleave as the host schedules them, so counts vary a
+// little from run to run.
+void core_access_flush(simulator& sim, core_state& c) {   // memory lock held
+    for (size_t f : c.accessed) {
+        if (!sim.frame_table[f].is_mapped) { continue; }
+        sim.pte(sim.page_of_frame(f)).is_used = true;
+        sim.policy->on_access(f);
+    }
+    c.accessed.clear();
+}
+
+void run_core(simulator& sim, std::mutex& memory, core_state& c, std::atomic<size_t>& waiting) {
+    size_t page, offset, frame;
+    waiting.fetch_sub(1);
+    while (waiting.load() != 0) { std::this_thread::yield(); }   // start together
+    for (size_t i = 0; i < c.addresses.size(); i++) {
+        if (c.pending.load(std::memory_order_acquire) != 0) { c.service(); }
+        get_page_offset(c.addresses[i], page, offset);
+        int val, index = c.tlb.lookup(page);
+        bool write = !c.ops.empty() && c.ops[i] == OP_WRITE;
+        if (index >= 0 && (!write || c.tlb.entries[index].is_dirty)) {
+            c.tlb.touch(index);
+            ++c.hits;
+            c.dirty_writes += write;
+            frame = c.tlb.entries[index].frame_num;
+            val = (int)sim.frame_data[frame][offset];
+            c.accessed.push_back(frame);
+            if (c.accessed.size() >= MC_ACCESS_BATCH) {
+                while (!memory.try_lock()) { c.service();  std::this_thread::yield(); }
+                core_access_flush(sim, c);
+                memory.unlock();
+            }
+        } else {
+            while (!memory.try_lock()) { c.service();  std::this_thread::yield(); }
+            sim.running = c.id;
+            core_access_flush(sim, c);
+            index = c.tlb.lookup(page);   // IPIs taken while waiting may have dropped the translation
+            bool faulted = false;
+            if (index >= 0) {             // a first write through a clean entry: only the dirty bit to set
+                c.tlb.touch(index);
+                ++c.hits;
+                frame = c.tlb.entries[index].frame_num;
+                c.accessed.push_back(frame);
+            } else {
+                ++c.walks;
+                faulted = !sim.page_walk(page);
+                if (faulted) {
+                    sim.page_fault(frame, page);
+                    ++c.faults;
+                } else {
+                    sim.tlb_miss(frame, page);
+                }
+            }
+            val = (int)sim.frame_data[frame][offset];
+            if (write) { sim.mark_dirty(page); }
+            if (faulted && sim.options.prefetch) { sim.prefetcher.on_fault(page); }
+            memory.unlock();
+            std::this_thread::yield();   // a walk is slow: let the other cores run, even on a host with fewer CPUs
+        }
+        if (c.values[i] != INT_MIN && c.values[i] != val) { ++c.failed; }
+        ++c.refs;
+    }
+    c.done.store(true, std::memory_order_release);
+}
+
+void run_multicore(const std::vector<size_t>& core_counts) {
+    std::vector<uint32_t> pids;
+    std::vector<unsigned char> ops;
+    std::vector<size_t> trace = load_addresses(options.address_file, &pids, &ops);
+    std::vector<int> values;
+    if (options.verify) { values = load_values(options.correct_file); }
+    if (core_counts.size() > 1) {
+        printf("%-6s %12s %9s %12s %9s %12s %12s %10s  %s\n", "cores", "faults", "fault%", "tlb hits", "hit%",
+               "shootdowns", "IPIs", "cycles/ref", "values");
+    }
+    for (size_t ncores : core_counts) {
+        simulator* sim = new simulator(options);
+        std::vector<core_state*> cores;
+        for (size_t c = 0; c < ncores; c++) {
+            cores.push_back(new core_state());
+            cores[c]->id = c;
+            cores[c]->tlb.init(options.tlb_size, options.tlb_ways, options.tlb_repl);
+        }
+        for (size_t i = 0; i < trace.size(); i++) {   // a tagged trace names each reference's thread, otherwise each core takes a slice
+            core_state& c = *cores[pids.empty() ? i * ncores / trace.size() : pids[i] % ncores];
+            c.addresses.push_back(trace[i]);
+            c.values.push_back(i < values.size() ? values[i] : INT_MIN);
+            if (!ops.empty()) { c.ops.push_back(ops[i]); }
+        }
+        sim->cores = cores;
+        sim->sharers.assign(sim->nframes, 0);
+        std::mutex memory;
+        std::atomic<size_t> waiting(ncores);
+        std::vector<std::thread> threads;
+        for (core_state* c : cores) {
+            threads.emplace_back(run_core, std::ref(*sim), std::ref(memory), std::ref(*c), std::ref(waiting));
+        }
+        for (std::thread& t : threads) { t.join(); }
+        for (core_state* c : cores) { c->service(); }   // IPIs that raced with a core finishing
+        sim->flush_writeback();
+
+        size_t shootdowns = 0, ipis = 0;
+        for (core_state* c : cores) {
+            sim->nrefs += c->refs;
+            sim->tlb_hits += c->hits;
+            sim->failed_asserts += c->failed;
+            sim->stats.writes += c->dirty_writes;
+            shootdowns += c->shootdowns;
+            ipis += c->ipis_sent;
+        }
+        if (core_counts.size() == 1) {
+            sim->summarize();
+        } else {
+            printf("%-6zu %12zu %8.3f%% %12zu %8.3f%% %12zu %12zu %10.3f  %s\n", ncores, sim->pg_faults,
+                   percent(sim->pg_faults, sim->nrefs), sim->tlb_hits, percent(sim->tlb_hits, sim->nrefs), shootdowns, ipis,
+                   sim->nrefs ? (double)ipis * (options.ipi_cycles[0] + options.ipi_cycles[1]) / sim->nrefs : 0.0,
+                   !options.verify ? "-" : sim->failed_asserts ? "FAILED" : "passed");
+        }
+        sim->cores.clear();
+        delete sim;
+        for (core_state* c : cores) { delete c; }
+    }
+    if (core_counts.size() > 1) { printf("\n\t\t...done.\n"); }
+}
+
+// --concurrent: the page table and frame allocator as a translation service shared by
+// many threads with no locks. Page-table nodes are installed with CAS and leaves are
+// packed 64-bit PTEs. The thread whose CAS moves a PTE from empty to PTE_LOADING is the
+// only one to read the page from the backing store; the others wait for it to publish
+// the frame. Frames come from the shared pool FRAME_CACHE at a time into per-thread
+// caches, and once it is empty from a lock-free CLOCK sweep. A reader pins its frame and
+// re-checks the PTE; an evicted frame is reused only after its pins drain.
+struct lockfree_page_table {
+    unsigned levels = 0;
+    unsigned bits[PT_MAX_LEVELS];     // as in radix_page_table
+    unsigned shift[PT_MAX_LEVELS];
+    std::atomic<uint64_t>* root;      // interior slots hold child pointers, leaf slots packed PTEs
+    std::atomic<size_t> nodes{0};
+
+    lockfree_page_table(unsigned vpn_bits, unsigned nlevels) {
+        levels = split_levels(vpn_bits, nlevels, bits, shift);
+        root = make_node(0);
+    }
+    ~lockfree_page_table() {   // every node, breadth first; only the interior levels point anywhere
+        std::vector<std::atomic<uint64_t>*> level_nodes = { root }, below;
+        for (unsigned l = 0; l < levels; l++) {
+            below.clear();
+            for (std::atomic<uint64_t>* n : level_nodes) {
+                for (size_t i = 0; l + 1 < levels && i < ((size_t)1 << bits[l]); i++) {
+                    uint64_t child = n[i].load();
+                    if (child != 0) { below.push_back((std::atomic<uint64_t>*)(uintptr_t)child); }
+                }
+                delete[] n;
+            }
+            level_nodes.swap(below);
+        }
+    }
+
+    std::atomic<uint64_t>* make_node(unsigned level) {
+        ++nodes;
+        return new std::atomic<uint64_t>[(size_t)1 << bits[level]]();
+    }
+    size_t index(size_t page, unsigned level) const { return (page >> shift[level]) & (((size_t)1 << bits[level]) - 1); }
+
+    std::atomic<uint64_t>& slot(size_t page) {   // the PTE of page, allocating nodes on the way down
+        std::atomic<uint64_t>* n = root;
+        for (unsigned l = 0; ; l++) {
+            std::atomic<uint64_t>& s = n[index(page, l)];
+            if (l + 1 == levels) { return s; }
+            uint64_t child = s.load(std::memory_order_acquire);
+            if (child == 0) {
+                std::atomic<uint64_t>* fresh = make_node(l + 1);
+                if (s.compare_exchange_strong(child, (uint64_t)(uintptr_t)fresh, std::memory_order_acq_rel)) {
+                    child = (uint64_t)(uintptr_t)fresh;
+                } else {                              // another thread got there first; child is its node
+                    delete[] fresh;
+                    --nodes;
+                }
+            }
+            n = (std::atomic<uint64_t>*)(uintptr_t)child;
+        }
+    }
+};
+
+struct service_thread {
+    std::vector<size_t> addresses;
+    std::vector<int> values;              // INT_MIN where there is nothing to check
+    std::vector<size_t> cache;            // free frames taken from the pool
+    size_t chunk = 1;
+    size_t faults = 0, waits = 0, evictions = 0, failed = 0;
+};
+
+struct concurrent_memory {
+    size_t nframes, page_size;
+    lockfree_page_table table;
+    std::vector<char> ram;
+    std::vector<std::atomic<uint64_t>> owner;   // page + 1 in each frame, 0 while free or loading
+    std::vector<std::atomic<uint32_t>> pins;    // readers between translating to a frame and reading it
+    std::atomic<size_t> next_free{0}, hand{0};
+    FILE* fbacking = nullptr;
+    std::mutex backing_lock;                    // only without pread
+
+    concurrent_memory(const sim_options& o)
+        : nframes(o.nframes), page_size(o.page_size), table(o.vpn_bits, o.pt_levels), ram(o.nframes * o.page_size),
+          owner(o.nframes), pins(o.nframes) {
+        open_files(fbacking);
+    }
+    ~concurrent_memory() { close_files(fbacking); }
+
+    void read_page(size_t page, char* dst) {   // one backing-store read; past its end reads as zeros
+        memset(dst, 0, page_size);
+#if defined(HAVE_MMAP)
+        pread(fileno(fbacking), dst, page_size, (off_t)(page * page_size));
+#else
+        std::lock_guard<std::mutex> hold(backing_lock);
+        fseek(fbacking, page * page_size, SEEK_SET);
+        fread(dst, 1, page_size, fbacking);
+#endif
+    }
+
+    size_t evict(service_thread& t) {   // CLOCK: clear used bits until a frame can be unmapped
+        for (;;) {
+            size_t f = hand.fetch_add(1, std::memory_order_relaxed) % nframes;
+            uint64_t p = owner[f].load(std::memory_order_acquire);
+            if (p == 0) { continue; }
+            std::atomic<uint64_t>& slot = table.slot(p - 1);
+            uint64_t e = slot.load(std::memory_order_acquire);
+            if (!(e & PTE_PRESENT) || (e & PTE_FRAME) != f) { continue; }
+            if (e & PTE_USED) { slot.compare_exchange_strong(e, e & ~PTE_USED);  continue; }   // second chance
+            if (!slot.compare_exchange_strong(e, 0)) { continue; }
+            owner[f].store(0, std::memory_order_release);
+            while (pins[f].load() != 0) { std::this_thread::yield(); }
+            ++t.evictions;
+            return f;
+        }
+    }
+
+    size_t alloc_frame(service_thread& t) {
+        if (t.cache.empty()) {
+            size_t first = next_free.fetch_add(t.chunk, std::memory_order_relaxed);
+            if (first >= nframes) { return evict(t); }
+            for (size_t f = std::min(first + t.chunk, nframes); f-- > first; ) { t.cache.push_back(f); }
+        }
+        size_t f = t.cache.back();
+        t.cache.pop_back();
+        return f;
+    }
+
+    int access(size_t page, size_t offset, service_thread& t) {   // translate, faulting if need be, and read the byte
+        std::atomic<uint64_t>& slot = table.slot(page);
+        bool waited = false;
+        for (;;) {
+            uint64_t e = slot.load(std::memory_order_acquire);
+            if (e & PTE_PRESENT) {
+                size_t f = (size_t)(e & PTE_FRAME);
+                pins[f].fetch_add(1);                   // seq_cst, against evict()'s unmap and pin check
+                if (((slot.load() ^ e) & ~PTE_USED) != 0) { pins[f].fetch_sub(1);  continue; }   // evicted meanwhile
+                if (!(e & PTE_USED)) { slot.compare_exchange_strong(e, e | PTE_USED); }
+                int val = (int)ram[f * page_size + offset];
+                pins[f].fetch_sub(1, std::memory_order_release);
+                return val;
+            }
+            if (e & PTE_LOADING) {                      // someone else's read is in flight
+                if (!waited) { waited = true;  ++t.waits; }
+                std::this_thread::yield();
+                continue;
+            }
+            if (!slot.compare_exchange_weak(e, PTE_LOADING, std::memory_order_acq_rel)) { continue; }
+            size_t f = alloc_frame(t);
+            read_page(page, &ram[f * page_size]);
+            ++t.faults;
+            owner[f].store(page + 1, std::memory_order_release);
+            slot.store(PTE_PRESENT | PTE_USED | f, std::memory_order_release);
+        }
+    }
+};
+
+void run_service_thread(concurrent_memory& mem, service_thread& t, std::atomic<size_t>& waiting) {
+    waiting.fetch_sub(1);
+    while (waiting.load() != 0) { std::this_thread::yield(); }
+    size_t page, offset;
+    for (size_t i = 0; i < t.addresses.size(); i++) {
+        get_page_offset(t.addresses[i], page, offset);
+        int val = mem.access(page, offset, t);
+        if (t.values[i] != INT_MIN && t.values[i] != val) { ++t.failed; }
     }
-    close_files(faddress, fcorrect, fbacking);  // and time to wrap things up
-    free(ram);
-    summarize(pg_faults, tlb_hits);
 }
 
+void run_concurrent(const std::vector<size_t>& thread_counts) {
+    std::vector<size_t> trace = load_addresses(options.address_file);
+    std::vector<int> values;
+    if (options.verify) { values = load_values(options.correct_file); }
+    printf("Concurrent translation: %zu references, %zu frames, CLOCK replacement\n\n", trace.size(), options.nframes);
+    printf("%-8s %12s %12s %12s %10s %12s %9s  %s\n", "threads", "faults", "shared", "evictions", "seconds", "Mrefs/s", "speedup", "values");
+    double base = 0;
+    for (size_t n : thread_counts) {
+        concurrent_memory mem(options);
+        std::vector<service_thread> workers(n);
+        for (size_t i = 0; i < trace.size(); i++) {   // each thread serves a slice of the trace
+            service_thread& t = workers[i * n / trace.size()];
+            t.addresses.push_back(trace[i]);
+            t.values.push_back(i < values.size() ? values[i] : INT_MIN);
+        }
+        for (service_thread& t : workers) { t.chunk = std::max((size_t)1, std::min((size_t)FRAME_CACHE, options.nframes / (4 * n))); }
+
+        std::atomic<size_t> waiting(n);
+        std::vector<std::thread> threads;
+        auto start = std::chrono::steady_clock::now();
+        for (service_thread& t : workers) { threads.emplace_back(run_service_thread, std::ref(mem), std::ref(t), std::ref(waiting)); }
+        for (std::thread& t : threads) { t.join(); }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        size_t faults = 0, waits = 0, evictions = 0, failed = 0;
+        for (service_thread& t : workers) {
+            faults += t.faults;
+            waits += t.waits;
+            evictions += t.evictions;
+            failed += t.failed;
+        }
+        double rate = seconds > 0 ? trace.size() / seconds / 1e6 : 0.0;
+        if (base == 0) { base = rate; }
+        printf("%-8zu %12zu %12zu %12zu %10.4f %12.3f %8.2fx  %s\n", n, faults, waits, evictions, seconds, rate,
+               base > 0 ? rate / base : 0.0, !options.verify ? "-" : failed ? "FAILED" : "passed");
+        fflush(stdout);
+    }
+    printf("\n(faults: backing-store reads, one per page brought in; shared: references that waited on another thread's read)\n");
+    printf("\n\t\t...done.\n");
+}
+
+// Mattson's stack algorithm: under LRU a reference hits with F frames exactly when its
+// stack distance (distinct pages touched since the previous reference to the same page,
+// itself included) is at most F, so one pass yields the fault count for every F at once.
+// Each page's latest reference time is marked in a Fenwick tree; the distance is the
+// number of marks after the page's previous time, O(log n) per reference. When the time
+// axis fills up, the marks (one per distinct page) are renumbered densely, so memory
+// stays proportional to the number of distinct pages however long the trace is.
+struct stack_distance {
+    std::vector<int> tree;                          // Fenwick tree over time slots, 1-based
+    std::unordered_map<size_t, size_t> last;        // page -> slot of its latest reference
+    size_t now = 0;                                 // slots used so far
+    std::vector<size_t> histogram;                  // histogram[d]: references at stack distance d
+    size_t cold = 0;                                // first references, misses at any size
+
+    stack_distance() : tree(MRC_MIN_SLOTS + 1, 0) {}
+
+    void add(size_t slot, int delta) { for (; slot < tree.size(); slot += slot & (0 - slot)) { tree[slot] += delta; } }
+    size_t marks_upto(size_t slot) {
+        long long n = 0;
+        for (; slot > 0; slot -= slot & (0 - slot)) { n += tree[slot]; }
+        return (size_t)n;
+    }
+
+    void renumber() {   // squeeze the live marks into slots 1 .. last.size(), keeping their order
+        std::vector<std::pair<size_t, size_t>> live(last.begin(), last.end());   // (page, slot)
+        std::sort(live.begin(), live.end(), [](const std::pair<size_t, size_t>& a, const std::pair<size_t, size_t>& b) {
+            return a.second < b.second;
+        });
+        size_t slots = std::max((size_t)MRC_MIN_SLOTS, 2 * live.size());
+        tree.assign(slots + 1, 0);
+        now = 0;
+        for (const std::pair<size_t, size_t>& p : live) {
+            last[p.first] = ++now;
+            add(now, 1);
+        }
+    }
+
+    size_t reference(size_t page) {   // the reference's stack distance, 0 for a first reference
+        if (now + 1 >= tree.size()) { renumber(); }
+        size_t slot = ++now;
+        auto it = last.find(page);
+        if (it == last.end()) {
+            ++cold;
+            last.emplace(page, slot);
+        } else {
+            size_t d = marks_upto(slot - 1) - marks_upto(it->second) + 1;
+            if (d >= histogram.size()) { histogram.resize(d + 1, 0); }
+            ++histogram[d];
+            add(it->second, -1);
+            it->second = slot;
+            add(slot, 1);
+            return d;
+        }
+        add(slot, 1);
+        return 0;
+    }
+
+    void forget(size_t page) {   // drop a page from the stack, as if never referenced
+        auto it = last.find(page);
+        if (it == last.end()) { return; }
+        add(it->second, -1);
+        last.erase(it);
+    }
+};
+
+void run_mrc() {   // LRU faults for every frame count, from one pass over the trace
+    trace_source* trace = open_trace(options.address_file);
+    std::vector<size_t> batch;
+    std::vector<unsigned char> ops;
+    stack_distance sd;
+    size_t nrefs = 0;
+    while (trace->next_batch(batch, ops)) {
+        for (size_t x : batch) { sd.reference(get_page(x)); }
+        nrefs += batch.size();
+    }
+    delete trace;
+
+    size_t distinct = sd.last.size();
+    printf("LRU miss-ratio curve: %zu references, %zu distinct pages, %zu cold misses\n\n", nrefs, distinct, sd.cold);
+    printf("%7s %12s %9s\n", "frames", "faults", "fault%");
+    size_t faults = nrefs;   // with no frames every reference faults; each extra frame saves the hits at that distance
+    for (size_t f = 1; f <= distinct; f++) {
+        if (f < sd.histogram.size()) { faults -= sd.histogram[f]; }
+        printf("%7zu %12zu %8.3f%%\n", f, faults, percent(faults, nrefs));
+    }
+    printf("\n(%zu or more frames: cold misses only)\n", distinct);
+    printf("\n\t\t...done.\n");
+}
+
+// A FIFO memory of `capacity` frames that only counts misses; misses and refs are
+// weights so a SHARDS run can rescale them when its sampling rate drops.
+struct mini_fifo {
+    size_t frames;              // the full-size memory this one models
+    size_t capacity;
+    std::deque<size_t> order;   // oldest first
+    std::unordered_set<size_t> resident;
+    double misses = 0, refs = 0;
+
+    mini_fifo(size_t f, double rate) : frames(f) { resize(rate); }
+
+    void resize(double rate) {  // a sampled trace at this rate sees memory scaled down by it
+        capacity = std::max((size_t)1, (size_t)llround(frames * rate));
+        while (order.size() > capacity) { resident.erase(order.front());  order.pop_front(); }
+    }
+    void reference(size_t page) {
+        refs += 1;
+        if (resident.count(page)) { return; }
+        misses += 1;
+        order.push_back(page);
+        resident.insert(page);
+        if (order.size() > capacity) { resident.erase(order.front());  order.pop_front(); }
+    }
+    void forget(size_t page) {
+        if (resident.erase(page) == 0) { return; }
+        order.erase(std::find(order.begin(), order.end(), page));
+    }
+    double miss_ratio() const { return refs > 0 ? misses / refs : 0.0; }
+};
+
+uint64_t shards_hash(size_t page) {  // splitmix64 finalizer, mod SHARDS_MODULUS
+    uint64_t z = (uint64_t)page + 0x9e3779b97f4a7c15ull;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return (z ^ (z >> 31)) % SHARDS_MODULUS;
+}
+
+// SHARDS (Waldspurger et al. 2015): spatially hashed sampling. A page is sampled, all
+// of its references or none, when its hash falls below a threshold T, so the rate is
+// R = T / SHARDS_MODULUS. LRU stack distances measured on the sampled pages are scaled
+// by 1/R; FIFO, which has no stack property, is estimated with miniature simulations
+// whose memories are scaled by R (Waldspurger et al. 2017). Fixed-rate keeps T; the
+// fixed-size variant starts at R = 1 and, whenever more than max_pages pages are being
+// tracked, lowers T to the largest tracked hash, drops those pages and rescales the
+// counts gathered so far. Either way the work and memory scale with the sampled pages.
+struct shards_mrc {
+    uint64_t threshold;
+    size_t max_pages;                               // fixed-size bound, 0 for fixed-rate
+    std::set<std::pair<uint64_t, size_t>> tracked;  // (hash, page), fixed-size only
+    stack_distance sd;
+    std::vector<double> lru_hist;                   // scaled stack distance -> weight; the last bucket is "beyond"
+    double lru_refs = 0;
+    std::vector<mini_fifo> fifo;
+    size_t sampled = 0;
+
+    shards_mrc(double rate, size_t pages, const std::vector<size_t>& frame_counts)
+        : threshold(pages ? SHARDS_MODULUS : (uint64_t)(rate * SHARDS_MODULUS)), max_pages(pages),
+          lru_hist(frame_counts.back() + 2, 0.0) {
+        for (size_t f : frame_counts) { fifo.emplace_back(f, this->rate()); }
+    }
+
+    double rate() const { return (double)threshold / SHARDS_MODULUS; }
+
+    void lower_threshold() {   // fixed-size: evict the pages with the largest hash
+        double old_rate = rate();
+        threshold = tracked.rbegin()->first;
+        while (!tracked.empty() && tracked.rbegin()->first >= threshold) {
+            size_t page = tracked.rbegin()->second;
+            tracked.erase(std::prev(tracked.end()));
+            sd.forget(page);
+            for (mini_fifo& m : fifo) { m.forget(page); }
+        }
+        double scale = rate() / old_rate;
+        for (double& w : lru_hist) { w *= scale; }
+        lru_refs *= scale;
+        for (mini_fifo& m : fifo) {
+            m.misses *= scale;
+            m.refs *= scale;
+            m.resize(rate());
+        }
+    }
+
+    void reference(size_t page) {
+        uint64_t h = shards_hash(page);
+        if (h >= threshold) { return; }
+        ++sampled;
+        size_t d = sd.reference(page);
+        lru_refs += 1;
+        if (d > 0) {
+            size_t scaled = std::max((size_t)1, (size_t)llround(d / rate()));
+            lru_hist[std::min(scaled, lru_hist.size() - 1)] += 1;
+        }
+        for (mini_fifo& m : fifo) { m.reference(page); }
+        if (max_pages && d == 0) {
+            tracked.insert({h, page});
+            if (tracked.size() > max_pages) { lower_threshold(); }
+        }
+    }
+
+    void adjust(size_t nrefs) {   // SHARDS-adj: credit the sampling shortfall to the smallest distance
+        if (max_pages) { return; }
+        lru_hist[1] += nrefs * rate() - lru_refs;
+        lru_refs = nrefs * rate();
+    }
+
+    double lru_miss_ratio(size_t frames) const {
+        if (lru_refs <= 0) { return 0.0; }
+        double hits = 0;
+        for (size_t d = 1; d <= frames && d < lru_hist.size(); d++) { hits += lru_hist[d]; }
+        return std::min(1.0, std::max(0.0, 1.0 - hits / lru_refs));
+    }
+};
+
+void run_shards(double rate, size_t max_pages, std::vector<size_t> frame_counts, bool compare) {
+    if (frame_counts.empty()) {   // powers of two up to the whole page table
+        for (size_t f = 1; f <= std::min(options.max_page + 1, (size_t)1 << 20); f *= 2) { frame_counts.push_back(f); }
+    }
+    std::sort(frame_counts.begin(), frame_counts.end());
+    shards_mrc est(rate, max_pages, frame_counts);
+    stack_distance exact_lru;
+    std::vector<mini_fifo> exact_fifo;
+    if (compare) {
+        for (size_t f : frame_counts) { exact_fifo.emplace_back(f, 1.0); }
+    }
+
+    trace_source* trace = open_trace(options.address_file);
+    std::vector<size_t> batch;
+    std::vector<unsigned char> ops;
+    size_t nrefs = 0;
+    while (trace->next_batch(batch, ops)) {
+        for (size_t x : batch) {
+            size_t page = get_page(x);
+            est.reference(page);
+            if (compare) {
+                exact_lru.reference(page);
+                for (mini_fifo& m : exact_fifo) { m.reference(page); }
+            }
+        }
+        nrefs += batch.size();
+    }
+    delete trace;
+    est.adjust(nrefs);
+
+    if (max_pages) {
+        printf("SHARDS fixed-size (%zu pages, final rate %.6f)", max_pages, est.rate());
+    } else {
+        printf("SHARDS fixed-rate (rate %.6f)", est.rate());
+    }
+    printf(": %zu references, %zu sampled (%1.3f%%)\n\n", nrefs, est.sampled, percent(est.sampled, nrefs));
+    printf("%7s %9s %9s", "frames", "lru%", "fifo%");
+    if (compare) { printf(" %9s %9s %9s %9s", "exact lru", "error", "exact fifo", "error"); }
+    printf("\n");
+
+    double lru_error = 0, fifo_error = 0;
+    for (size_t i = 0; i < frame_counts.size(); i++) {
+        size_t f = frame_counts[i];
+        double lru = 100 * est.lru_miss_ratio(f), fifo = 100 * est.fifo[i].miss_ratio();
+        printf("%7zu %8.3f%% %8.3f%%", f, lru, fifo);
+        if (compare) {
+            size_t lru_faults = exact_lru.cold;   // Mattson: faults at f frames are the cold misses plus distances beyond f
+            for (size_t d = f + 1; d < exact_lru.histogram.size(); d++) { lru_faults += exact_lru.histogram[d]; }
+            double exact = percent(lru_faults, nrefs), exact_f = 100 * exact_fifo[i].miss_ratio();
+            printf(" %8.3f%% %+8.3f%% %9.3f%% %+8.3f%%", exact, lru - exact, exact_f, fifo - exact_f);
+            lru_error += fabs(lru - exact);
+            fifo_error += fabs(fifo - exact_f);
+        }
+        printf("\n");
+    }
+    if (compare) {
+        printf("\nMean absolute error: LRU %1.3f%%, FIFO %1.3f%% (percentage points)\n",
+               lru_error / frame_counts.size(), fifo_error / frame_counts.size());
+    }
+    printf("\n\t\t...done.\n");
+}
+
+void usage(const char* prog) {
+    fprintf(stderr, "usage: %s [-p policy] [-f frames] [-l entries] [-a ways] [-m | -z] [-c pages] [-s] [-q] [-w refs]\n"
+                    "          [-j threads] [--address-bits n] [--page-size n] [--levels n | --ipt] [--huge pages,... [--huge-tlb n]\n"
+                    "          [--promote refs]] [--tlb-repl r] [--stlb n [--stlb-ways n] [--stlb-repl r] [--stlb-exclusive]]\n"
+                    "          [--tlb-latency l1,stlb,step] [--tlb-prefetch p [--tlb-prefetch-buffer n]] [--quantum refs] [--flush]\n"
+                    "          [--write-back] [--wb-batch pages] [-t trace] [-x values | -n]\n", prog);
+    fprintf(stderr, "       %s --cores n,... [--ipi-cycles send,receive] [-p policy] [-f frames] [-l entries] [-t trace]\n", prog);
+    fprintf(stderr, "       %s --concurrent threads,... [-f frames] [--address-bits n] [--page-size n] [--levels n] [-t trace]\n", prog);
+    fprintf(stderr, "       %s --mrc [-t trace]\n", prog);
+    fprintf(stderr, "       %s --shards rate | --shards-size pages [--compare] [-f frames,...] [-t trace]\n", prog);
+    fprintf(stderr, "       %s --convert addresses.txt trace.bin\n", prog);
+    fprintf(stderr, "  -p policy   page replacement policy (default %s):", DEFAULT_POLICY);
+    for (const policy_entry& p : policies) { fprintf(stderr, " %s", p.name); }
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  -f frames   physical frames (default %d)\n", NFRAMES);
+    fprintf(stderr, "  -l entries  TLB entries (default %d)\n", TLB_SIZE);
+    fprintf(stderr, "  -a ways     TLB associativity, capped at the TLB size (default %d)\n", TLB_WAYS);
+    fprintf(stderr, "  --tlb-repl r      TLB replacement: fifo (default), lru, plru (tree pseudo-LRU), random, nru\n");
+    fprintf(stderr, "                    (not recently used) or srrip (re-reference prediction); a list sweeps them\n");
+    fprintf(stderr, "  --stlb n          second-level TLB entries, looked up on an L1 miss (default none)\n");
+    fprintf(stderr, "  --stlb-ways n     its associativity (default %d); --stlb-repl r its replacement (default lru)\n", STLB_WAYS);
+    fprintf(stderr, "  --stlb-exclusive  fill the STLB with L1 victims only, instead of with every walk\n");
+    fprintf(stderr, "  --tlb-latency l1,stlb,step  cycles per L1 lookup, STLB lookup and page-walk read (default %d,%d,%d)\n",
+            TLB_CYCLES, STLB_CYCLES, WALK_STEP_CYCLES);
+    fprintf(stderr, "  --tlb-prefetch p  on a page walk, also install translations of predicted resident pages: none\n");
+    fprintf(stderr, "                    (default), sequential (next page), stride (repeated miss distance) or\n");
+    fprintf(stderr, "                    distance (distances that followed the last one, from a %d-row table)\n", TLBPF_ROWS);
+    fprintf(stderr, "  --tlb-prefetch-buffer n  hold them in an n-entry buffer beside L1 instead of in the TLB\n");
+    fprintf(stderr, "              -p, -f, -l and --tlb-repl take comma-separated lists: more than one value runs every\n");
+    fprintf(stderr, "              combination in parallel over the same trace and prints a table\n");
+    fprintf(stderr, "  -j threads  sweep worker threads (default one per core)\n");
+    fprintf(stderr, "  --address-bits n  virtual address width, up to 64 (default %d)\n", ADDRESS_BITS);
+    fprintf(stderr, "  --page-size n     page and frame size in bytes, a power of two (default %d)\n", FRAME_SIZE);
+    fprintf(stderr, "  --levels n        radix page-table levels, 1 to %d (default %d)\n", PT_MAX_LEVELS, PT_LEVELS);
+    fprintf(stderr, "  --ipt             hashed inverted page table, sized by frames, instead of the radix tree\n");
+    fprintf(stderr, "  --huge pages,...  up to %d huge page sizes, in base pages (powers of two), each with its own TLB\n", HUGE_SIZES);
+    fprintf(stderr, "  --huge-tlb n      entries in each huge-page TLB (default %d)\n", HUGE_TLB_SIZE);
+    fprintf(stderr, "  --promote refs    references that make a fully resident region a huge page (default its page count)\n");
+    fprintf(stderr, "  -m          mmap the backing store and page in with a single copy\n");
+    fprintf(stderr, "  -z          mmap the backing store and map frames onto it without copying\n");
+    fprintf(stderr, "  -c pages    fault-around: read this many aligned pages per fault (power of two, max %d)\n", MAX_CLUSTER);
+    fprintf(stderr, "  -s          adaptive stride/sequential prefetcher driven by the fault stream\n");
+    fprintf(stderr, "  -q          quiet: summary only, no per-reference log\n");
+    fprintf(stderr, "  -w refs     print fault and TLB hit rates every refs references (k, M, G suffixes)\n");
+    fprintf(stderr, "  -t trace    addresses to simulate, text or binary, - for stdin (default addresses.txt)\n");
+    fprintf(stderr, "              a text trace may tag addresses with a process ID, pid:address, for one\n");
+    fprintf(stderr, "              page table per process sharing the frames and ASID-tagged TLB entries\n");
+    fprintf(stderr, "  --quantum refs    run the processes round-robin, refs references each (default: trace order)\n");
+    fprintf(stderr, "  --flush           flush the TLBs on every context switch instead of keeping ASID-tagged entries\n");
+    fprintf(stderr, "  --write-back      write dirty victims to BACKING_STORE.bin; without it the writes are only counted\n");
+    fprintf(stderr, "  --wb-batch pages  dirty victims queued, then sorted and written in runs of consecutive pages\n");
+    fprintf(stderr, "                    (default %d); references marked w in the trace dirty their page\n", WB_BATCH);
+    fprintf(stderr, "  -x values   expected values to check against (default correct.txt)\n");
+    fprintf(stderr, "  -n          do not check values\n");
+    fprintf(stderr, "  --cores n   run the trace on n simulated cores, one host thread each, with private TLBs and\n");
+    fprintf(stderr, "              shared frames; pid:address tags pick the core (pid %% n), else each takes a slice.\n");
+    fprintf(stderr, "              Evictions shoot down other cores' translations; a list compares core counts\n");
+    fprintf(stderr, "  --ipi-cycles send,receive  modelled cost of one shootdown IPI (default %d,%d)\n", SHOOTDOWN_CYCLES, IPI_CYCLES);
+    fprintf(stderr, "  --concurrent threads  benchmark the lock-free page table and frame allocator, the trace split\n");
+    fprintf(stderr, "              over this many threads (a list runs each, e.g. 1,2,4,8,16,32,64)\n");
+    fprintf(stderr, "  --mrc       print LRU faults for every frame count from one pass over the trace\n");
+    fprintf(stderr, "  --shards    approximate LRU and FIFO miss ratios from a hashed sample of pages at this rate\n");
+    fprintf(stderr, "  --shards-size  the same, sampling at most this many pages and lowering the rate to fit\n");
+    fprintf(stderr, "  --compare   with --shards: also compute the exact curves and report the error\n");
+    fprintf(stderr, "  --convert   write a text address file as a compact binary trace and exit\n");
+    exit(ARGC_ERROR);
+}
+
+
+int parse_tlb_prefetch(const char* name, const char* prog) {
+    for (int k = 0; k < (int)(sizeof tlbpf_names / sizeof tlbpf_names[0]); k++) {
+        if (strcmp(name, tlbpf_names[k]) == 0) { return k; }
+    }
+    fprintf(stderr, "Unknown TLB prefetcher: '%s'\n", name);
+    usage(prog);
+    return TLBPF_NONE;
+}
+
+int parse_tlb_repl(const char* name, const char* prog) {
+    for (int r = 0; r < (int)(sizeof tlb_repl_names / sizeof tlb_repl_names[0]); r++) {
+        if (strcmp(name, tlb_repl_names[r]) == 0) { return r; }
+    }
+    fprintf(stderr, "Unknown TLB replacement policy: '%s'\n", name);
+    usage(prog);
+    return TLB_FIFO;
+}
+
+std::vector<int> parse_tlb_repls(const char* list, const char* prog) {  // "lru,srrip"
+    std::vector<int> repls;
+    for (const char* p = list; ; ) {
+        const char* comma = strchr(p, ',');
+        std::string name(p, comma ? (size_t)(comma - p) : strlen(p));
+        repls.push_back(parse_tlb_repl(name.c_str(), prog));
+        if (comma == nullptr) { return repls; }
+        p = comma + 1;
+    }
+}
+
+std::vector<size_t> parse_sizes(const char* list, const char* what, const char* prog) {  // "16,32,64"
+    std::vector<size_t> sizes;
+    const char* p = list;
+    for (;;) {
+        char* end;
+        size_t n = strtoul(p, &end, 10);
+        if (end == p || n == 0 || (*end != ',' && *end != '\0')) {
+            fprintf(stderr, "Invalid %s: '%s'\n", what, list);
+            usage(prog);
+        }
+        sizes.push_back(n);
+        if (*end == '\0') { return sizes; }
+        p = end + 1;
+    }
+}
+
+std::vector<const char*> parse_policies(const char* list, const char* prog) {  // "lru,arc,opt"
+    std::vector<const char*> names;
+    const char* p = list;
+    for (;;) {
+        const char* comma = strchr(p, ',');
+        std::string name(p, comma ? (size_t)(comma - p) : strlen(p));
+        const policy_entry* entry = find_policy(name.c_str());
+        if (entry == nullptr) {
+            fprintf(stderr, "Unknown replacement policy: '%s'\n", name.c_str());
+            usage(prog);
+        }
+        names.push_back(entry->name);
+        if (comma == nullptr) { return names; }
+        p = comma + 1;
+    }
+}
 
 int main(int argc, const char * argv[]) {
-    run_simulation();
+    std::vector<const char*> policy_names = { DEFAULT_POLICY };
+    std::vector<size_t> frame_counts = { NFRAMES }, tlb_sizes = { TLB_SIZE };
+    std::vector<int> tlb_repls = { TLB_FIFO };
+    bool mrc = false, compare = false, frames_given = false;
+    const char* convert_in = nullptr;
+    const char* convert_out = nullptr;
+    double shards_rate = 0;
+    size_t shards_pages = 0;
+    std::vector<size_t> huge_pages, core_counts, thread_counts;
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--policy") == 0) && i + 1 < argc) {
+            policy_names = parse_policies(argv[++i], argv[0]);
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            frame_counts = parse_sizes(argv[++i], "frame count", argv[0]);
+            frames_given = true;
+        } else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+            tlb_sizes = parse_sizes(argv[++i], "TLB size", argv[0]);
+        } else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+            options.tlb_ways = parse_sizes(argv[++i], "TLB associativity", argv[0])[0];
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            options.jobs = parse_sizes(argv[++i], "thread count", argv[0])[0];
+        } else if (strcmp(argv[i], "-m") == 0) {
+            options.pagein = PAGEIN_MMAP;
+        } else if (strcmp(argv[i], "-z") == 0) {
+            options.pagein = PAGEIN_REMAP;
+        } else if (strcmp(argv[i], "--convert") == 0 && i + 2 < argc) {
+            convert_in = argv[++i];
+            convert_out = argv[++i];
+        } else if (strcmp(argv[i], "--address-bits") == 0 && i + 1 < argc) {
+            options.address_bits = (unsigned)parse_sizes(argv[++i], "address width", argv[0])[0];
+        } else if (strcmp(argv[i], "--page-size") == 0 && i + 1 < argc) {
+            options.page_size = parse_sizes(argv[++i], "page size", argv[0])[0];
+        } else if (strcmp(argv[i], "--ipt") == 0) {
+            options.inverted = true;
+        } else if (strcmp(argv[i], "--levels") == 0 && i + 1 < argc) {
+            options.pt_levels = (unsigned)parse_sizes(argv[++i], "page-table depth", argv[0])[0];
+        } else if (strcmp(argv[i], "--tlb-repl") == 0 && i + 1 < argc) {
+            tlb_repls = parse_tlb_repls(argv[++i], argv[0]);
+        } else if (strcmp(argv[i], "--stlb") == 0 && i + 1 < argc) {
+            options.stlb_size = parse_sizes(argv[++i], "STLB size", argv[0])[0];
+        } else if (strcmp(argv[i], "--stlb-ways") == 0 && i + 1 < argc) {
+            options.stlb_ways = parse_sizes(argv[++i], "STLB associativity", argv[0])[0];
+        } else if (strcmp(argv[i], "--stlb-repl") == 0 && i + 1 < argc) {
+            options.stlb_repl = parse_tlb_repl(argv[++i], argv[0]);
+        } else if (strcmp(argv[i], "--stlb-exclusive") == 0) {
+            options.stlb_exclusive = true;
+        } else if (strcmp(argv[i], "--tlb-latency") == 0 && i + 1 < argc) {
+            std::vector<size_t> cycles = parse_sizes(argv[++i], "TLB latency", argv[0]);
+            if (cycles.size() != 3) {
+                fprintf(stderr, "Invalid TLB latency: '%s' (l1,stlb,step)\n", argv[i]);
+                usage(argv[0]);
+            }
+            for (int k = 0; k < 3; k++) { options.latency[k] = (unsigned)cycles[k]; }
+            options.show_latency = true;
+        } else if (strcmp(argv[i], "--tlb-prefetch") == 0 && i + 1 < argc) {
+            options.tlb_prefetch = parse_tlb_prefetch(argv[++i], argv[0]);
+        } else if (strcmp(argv[i], "--tlb-prefetch-buffer") == 0 && i + 1 < argc) {
+            options.tlb_pf_buffer = parse_sizes(argv[++i], "TLB prefetch buffer size", argv[0])[0];
+        } else if (strcmp(argv[i], "--write-back") == 0) {
+            options.write_back = true;
+        } else if (strcmp(argv[i], "--wb-batch") == 0 && i + 1 < argc) {
+            options.wb_batch = parse_sizes(argv[++i], "write-back batch", argv[0])[0];
+        } else if (strcmp(argv[i], "--huge") == 0 && i + 1 < argc) {
+            huge_pages = parse_sizes(argv[++i], "huge page size", argv[0]);
+        } else if (strcmp(argv[i], "--huge-tlb") == 0 && i + 1 < argc) {
+            options.huge_tlb = parse_sizes(argv[++i], "huge-page TLB size", argv[0])[0];
+        } else if (strcmp(argv[i], "--promote") == 0 && i + 1 < argc) {
+            options.promote_refs = parse_sizes(argv[++i], "promotion threshold", argv[0])[0];
+        } else if (strcmp(argv[i], "--quantum") == 0 && i + 1 < argc) {
+            options.quantum = parse_sizes(argv[++i], "quantum", argv[0])[0];
+        } else if (strcmp(argv[i], "--flush") == 0) {
+            options.tlb_flush = true;
+        } else if (strcmp(argv[i], "--cores") == 0 && i + 1 < argc) {
+            core_counts = parse_sizes(argv[++i], "core count", argv[0]);
+        } else if (strcmp(argv[i], "--concurrent") == 0 && i + 1 < argc) {
+            thread_counts = parse_sizes(argv[++i], "thread count", argv[0]);
+        } else if (strcmp(argv[i], "--ipi-cycles") == 0 && i + 1 < argc) {
+            std::vector<size_t> cycles = parse_sizes(argv[++i], "IPI cost", argv[0]);
+            if (cycles.size() != 2) {
+                fprintf(stderr, "Invalid IPI cost: '%s' (send,receive)\n", argv[i]);
+                usage(argv[0]);
+            }
+            options.ipi_cycles[0] = (unsigned)cycles[0];
+            options.ipi_cycles[1] = (unsigned)cycles[1];
+        } else if (strcmp(argv[i], "--mrc") == 0) {
+            mrc = true;
+        } else if (strcmp(argv[i], "--shards") == 0 && i + 1 < argc) {
+            shards_rate = strtod(argv[++i], NULL);
+            if (!(shards_rate > 0 && shards_rate <= 1)) {
+                fprintf(stderr, "Invalid sampling rate: '%s'\n", argv[i]);
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "--shards-size") == 0 && i + 1 < argc) {
+            shards_pages = parse_sizes(argv[++i], "sample size", argv[0])[0];
+        } else if (strcmp(argv[i], "--compare") == 0) {
+            compare = true;
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            options.address_file = argv[++i];
+        } else if (strcmp(argv[i], "-x") == 0 && i + 1 < argc) {
+            options.correct_file = argv[++i];
+        } else if (strcmp(argv[i], "-n") == 0) {
+            options.verify = false;
+        } else if (strcmp(argv[i], "-q") == 0) {
+            options.quiet = true;
+        } else if (strcmp(argv[i], "-s") == 0) {
+            options.prefetch = true;
+        } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            char* end;
+            options.window = strtoul(argv[++i], &end, 10);
+            if (*end == 'k' || *end == 'K') { options.window <<= 10;  ++end; }
+            else if (*end == 'M') { options.window <<= 20;  ++end; }
+            else if (*end == 'G') { options.window <<= 30;  ++end; }
+            if (options.window == 0 || *end != '\0') {
+                fprintf(stderr, "Invalid window: '%s'\n", argv[i]);
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            options.cluster = strtoul(argv[++i], NULL, 10);
+            if (options.cluster == 0 || options.cluster > MAX_CLUSTER || (options.cluster & (options.cluster - 1)) != 0) {
+                fprintf(stderr, "Invalid fault-around cluster: '%s'\n", argv[i]);
+                usage(argv[0]);
+            }
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (options.page_size < 2 || (options.page_size & (options.page_size - 1)) != 0) {
+        fprintf(stderr, "Page size must be a power of two: %zu\n", options.page_size);
+        exit(ARGC_ERROR);
+    }
+    for (options.page_bits = 0; ((size_t)1 << options.page_bits) < options.page_size; options.page_bits++) {}
+    if (options.address_bits > 64 || options.address_bits <= options.page_bits) {
+        fprintf(stderr, "A %u-bit address leaves no page number with %zu-byte pages\n", options.address_bits, options.page_size);
+        exit(ARGC_ERROR);
+    }
+    options.max_page = (options.address_bits == 64 ? SIZE_MAX : ((size_t)1 << options.address_bits) - 1) >> options.page_bits;
+    options.vpn_bits = options.address_bits - options.page_bits;
+    if (options.pt_levels < 1 || options.pt_levels > PT_MAX_LEVELS) {
+        fprintf(stderr, "Page tables have 1 to %d levels\n", PT_MAX_LEVELS);
+        exit(ARGC_ERROR);
+    }
+    unsigned widest = (options.vpn_bits + options.pt_levels - 1) / options.pt_levels;   // the top level's index bits
+    if ((!options.inverted || !thread_counts.empty()) && widest > PT_MAX_NODE_BITS) {
+        fprintf(stderr, "A %u-level page table over %u-bit page numbers needs %u-bit nodes (%.4g entries each), more than the\n"
+                        "%d bits a level may index: every node would be nearly a flat table. Use more --levels (up to %d)%s\n",
+                options.pt_levels, options.vpn_bits, widest, std::ldexp(1.0, (int)widest), PT_MAX_NODE_BITS, PT_MAX_LEVELS,
+                thread_counts.empty() ? ", --ipt or a smaller --address-bits" : " or a smaller --address-bits");
+        exit(ARGC_ERROR);
+    }
+    std::sort(huge_pages.begin(), huge_pages.end());
+    huge_pages.erase(std::unique(huge_pages.begin(), huge_pages.end()), huge_pages.end());
+    if (huge_pages.size() > HUGE_SIZES) {
+        fprintf(stderr, "At most %d huge page sizes\n", HUGE_SIZES);
+        exit(ARGC_ERROR);
+    }
+    for (size_t n : huge_pages) {
+        if (n < 2 || (n & (n - 1)) != 0 || n - 1 > options.max_page) {
+            fprintf(stderr, "A huge page is a power of two, at least 2, of the %zu base pages: %zu\n", options.max_page + 1, n);
+            exit(ARGC_ERROR);
+        }
+        options.huge_pages[options.huge_count++] = n;
+    }
+    if (convert_in != nullptr) {
+        convert_trace(convert_in, convert_out);
+        return 0;
+    }
+    options.tlb_repl = tlb_repls[0];
+    if (options.tlb_pf_buffer && options.tlb_prefetch == TLBPF_NONE) {
+        fprintf(stderr, "--tlb-prefetch-buffer needs --tlb-prefetch\n");
+        exit(ARGC_ERROR);
+    }
+    std::vector<size_t> all_sizes = tlb_sizes;
+    if (options.stlb_size) { all_sizes.push_back(options.stlb_size); }
+    for (size_t k = 0; k < all_sizes.size(); k++) {
+        bool second = options.stlb_size && k + 1 == all_sizes.size();
+        size_t t = all_sizes[k], ways = std::min(second ? options.stlb_ways : options.tlb_ways, t), sets = t / ways;
+        if (t % ways != 0 || (sets & (sets - 1)) != 0) {
+            fprintf(stderr, "A %zu-entry TLB with %zu ways does not give a power-of-two number of sets\n", t, ways);
+            exit(ARGC_ERROR);
+        }
+        bool plru = second ? options.stlb_repl == TLB_PLRU : std::count(tlb_repls.begin(), tlb_repls.end(), TLB_PLRU) != 0;
+        if (plru && (ways & (ways - 1)) != 0) {
+            fprintf(stderr, "Tree pseudo-LRU needs a power-of-two number of ways, not %zu\n", ways);
+            exit(ARGC_ERROR);
+        }
+    }
+    if (!thread_counts.empty()) {
+        for (size_t n : thread_counts) {
+            if (n >= frame_counts[0]) {   // every thread may hold a frame that is loading, which CLOCK cannot take
+                fprintf(stderr, "--concurrent needs more frames than threads: %zu threads, %zu frames\n", n, frame_counts[0]);
+                exit(ARGC_ERROR);
+            }
+        }
+        options.nframes = frame_counts[0];
+        run_concurrent(thread_counts);
+        return 0;
+    }
+    if (mrc) {
+        run_mrc();
+        return 0;
+    }
+    if (shards_rate > 0 || shards_pages > 0) {
+        run_shards(shards_rate, shards_pages, frames_given ? frame_counts : std::vector<size_t>(), compare);
+        return 0;
+    }
+    if (!core_counts.empty()) {
+        for (size_t n : core_counts) {
+            if (n > MAX_CORES) { fprintf(stderr, "At most %d cores\n", MAX_CORES);  exit(ARGC_ERROR); }
+        }
+        if (policy_names.size() * frame_counts.size() * tlb_sizes.size() * tlb_repls.size() > 1 || strcmp(policy_names[0], "opt") == 0 ||
+            options.huge_count || options.stlb_size || options.quantum || options.tlb_prefetch != TLBPF_NONE) {
+            fprintf(stderr, "--cores runs one policy other than opt, frame count and TLB size, without --huge, --stlb, --quantum "
+                            "or --tlb-prefetch\n");
+            exit(ARGC_ERROR);
+        }
+        options.policy_name = policy_names[0];
+        options.nframes = frame_counts[0];
+        options.tlb_size = tlb_sizes[0];
+    }
+    if (options.pagein != PAGEIN_READ) {
+        FILE* fbacking;
+        open_files(fbacking);
+        map_backing_store(fbacking);   // the mapping outlives the file
+        close_files(fbacking);
+    }
+
+    if (!core_counts.empty()) {
+        run_multicore(core_counts);
+    } else if (policy_names.size() * frame_counts.size() * tlb_sizes.size() * tlb_repls.size() > 1) {
+        if (policy_names.size() * frame_counts.size() * tlb_sizes.size() * tlb_repls.size() > MAX_SWEEP) {
+            fprintf(stderr, "Too many configurations to sweep (at most %d)\n", MAX_SWEEP);
+            exit(ARGC_ERROR);
+        }
+        run_sweep(policy_names, frame_counts, tlb_sizes, tlb_repls);
+    } else {
+        options.policy_name = policy_names[0];
+        options.nframes = frame_counts[0];
+        options.tlb_size = tlb_sizes[0];
+        if (strcmp(options.policy_name, "opt") == 0 && strcmp(options.address_file, "-") == 0) {
+            fprintf(stderr, "opt reads the trace ahead of the simulation and cannot take it from stdin\n");
+            exit(ARGC_ERROR);
+        }
+        run_simulation();
+    }
+    unmap_backing_store();
 // printf("\nFailed asserts: %lu\n\n", failed_asserts);   // allows asserts to fail silently and be counted
     return 0;
 }